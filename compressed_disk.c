@@ -0,0 +1,391 @@
+#include "compressed_disk.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "file_reader.h"
+
+bool compressed_disk_detect(FILE* fd) {
+    uint8_t magic[8];
+
+    if (pread(fileno(fd), magic, sizeof(magic), 0) != sizeof(magic)) return false;
+
+    return memcmp(magic, COMPRESSED_DISK_MAGIC, sizeof(magic)) == 0;
+}
+
+struct compressed_disk_t* compressed_disk_open(FILE* fd) {
+    if (fd == NULL) {
+        errno = EFAULT;
+        return NULL;
+    }
+
+    struct compressed_header_t header;
+    if (pread(fileno(fd), &header, sizeof(header), 0) != sizeof(header)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (memcmp(header.magic, COMPRESSED_DISK_MAGIC, sizeof(header.magic)) != 0 ||
+        header.chunk_size == 0 || header.chunk_size > COMPRESSED_DISK_MAX_CHUNK_SIZE ||
+        header.chunk_size % MIN_BYTES_PER_SECTOR != 0 ||
+        header.image_size / header.chunk_size + (header.image_size % header.chunk_size != 0) !=
+            header.chunks_n) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fileno(fd), &st) == -1) {
+        return NULL;
+    }
+    uint64_t file_size = st.st_size;
+
+    // The index must fit in the file before it is worth allocating
+    size_t index_size = (size_t)header.chunks_n * sizeof(struct chunk_index_t);
+    uint64_t data_start = sizeof(header) + (uint64_t)index_size;
+    if (data_start > file_size) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct compressed_disk_t* disk = calloc(1, sizeof(struct compressed_disk_t));
+    if (disk == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    disk->index = malloc(index_size > 0 ? index_size : 1);
+    if (disk->index == NULL) {
+        free(disk);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (pread(fileno(fd), disk->index, index_size, sizeof(header)) != (ssize_t)index_size) {
+        free(disk->index);
+        free(disk);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // Every stored chunk has to lie in the data area, raw ones at full length
+    for (uint32_t i = 0; i < header.chunks_n; i++) {
+        struct chunk_index_t* entry = &disk->index[i];
+        uint64_t left = header.image_size - (uint64_t)i * header.chunk_size;
+        uint32_t length = left < header.chunk_size ? (uint32_t)left : header.chunk_size;
+
+        bool valid;
+        switch (entry->type) {
+            case CHUNK_ZERO:
+                valid = entry->length == 0;
+                break;
+            case CHUNK_ZLIB:
+                valid = entry->length > 0 && entry->length <= compressBound(length);
+                break;
+            case CHUNK_RAW:
+                valid = entry->length == length;
+                break;
+            default:
+                valid = false;
+                break;
+        }
+
+        if (!valid || (entry->type != CHUNK_ZERO &&
+                       (entry->offset < data_start || entry->offset > file_size ||
+                        entry->length > file_size - entry->offset))) {
+            free(disk->index);
+            free(disk);
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+
+    disk->fd = fileno(fd);
+    disk->chunk_size = header.chunk_size;
+    disk->chunks_n = header.chunks_n;
+    disk->image_size = header.image_size;
+    pthread_mutex_init(&disk->cache_lock, NULL);
+
+    for (int i = 0; i < COMPRESSED_DISK_CACHE_SIZE; i++) {
+        disk->cache[i].chunk = UINT32_MAX;
+    }
+
+    return disk;
+}
+
+uint32_t chunk_length(struct compressed_disk_t* disk, uint32_t chunk) {
+    uint64_t start = (uint64_t)chunk * disk->chunk_size;
+    uint64_t left = disk->image_size - start;
+
+    return left < disk->chunk_size ? (uint32_t)left : disk->chunk_size;
+}
+
+// Decompresses a chunk into `out`, which must hold `chunk_size` bytes
+int load_chunk(struct compressed_disk_t* disk, uint32_t chunk, uint8_t* out) {
+    struct chunk_index_t* entry = &disk->index[chunk];
+    uint32_t length = chunk_length(disk, chunk);
+
+    if (entry->type == CHUNK_RAW) {
+        if (entry->length != length ||
+            pread(disk->fd, out, length, entry->offset) != (ssize_t)length) {
+            errno = EIO;
+            return -1;
+        }
+        return 0;
+    }
+
+    uint8_t* compressed = malloc(entry->length > 0 ? entry->length : 1);
+    if (compressed == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (pread(disk->fd, compressed, entry->length, entry->offset) != (ssize_t)entry->length) {
+        free(compressed);
+        errno = EIO;
+        return -1;
+    }
+
+    uLongf out_len = length;
+    int result = uncompress(out, &out_len, compressed, entry->length);
+    free(compressed);
+
+    if (result != Z_OK || out_len != length) {
+        errno = EIO;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Copies part of a chunk into `buffer`, decompressing it only on a cache miss
+int read_chunk(struct compressed_disk_t* disk, uint32_t chunk, uint32_t offset,
+               uint8_t* buffer, size_t len) {
+    if (disk->index[chunk].type == CHUNK_ZERO) {
+        memset(buffer, 0, len);
+        return 0;
+    }
+
+    pthread_mutex_lock(&disk->cache_lock);
+    for (int i = 0; i < COMPRESSED_DISK_CACHE_SIZE; i++) {
+        if (disk->cache[i].chunk == chunk) {
+            disk->cache[i].last_used = ++disk->cache_clock;
+            memcpy(buffer, disk->cache[i].data + offset, len);
+            pthread_mutex_unlock(&disk->cache_lock);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&disk->cache_lock);
+
+    // Decompress outside the lock so other threads can keep hitting the cache
+    uint8_t* data = malloc(disk->chunk_size);
+    if (data == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (load_chunk(disk, chunk, data) == -1) {
+        free(data);
+        return -1;
+    }
+
+    memcpy(buffer, data + offset, len);
+
+    pthread_mutex_lock(&disk->cache_lock);
+    struct chunk_cache_t* victim = &disk->cache[0];
+    for (int i = 0; i < COMPRESSED_DISK_CACHE_SIZE; i++) {
+        // Another thread may have loaded the same chunk meanwhile
+        if (disk->cache[i].chunk == chunk) {
+            victim = NULL;
+            break;
+        }
+        if (disk->cache[i].last_used < victim->last_used) victim = &disk->cache[i];
+    }
+
+    if (victim != NULL) {
+        free(victim->data);
+        victim->chunk = chunk;
+        victim->data = data;
+        victim->last_used = ++disk->cache_clock;
+        data = NULL;
+    }
+    pthread_mutex_unlock(&disk->cache_lock);
+
+    free(data);
+
+    return 0;
+}
+
+int compressed_disk_read(struct compressed_disk_t* disk, uint64_t offset, void* buffer,
+                         size_t len) {
+    if (disk == NULL || buffer == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if (offset + len > disk->image_size) {
+        errno = ERANGE;
+        return -1;
+    }
+
+    uint8_t* out = buffer;
+    while (len > 0) {
+        uint32_t chunk = offset / disk->chunk_size;
+        uint32_t chunk_offset = offset % disk->chunk_size;
+        size_t n = disk->chunk_size - chunk_offset;
+        if (n > len) n = len;
+
+        if (read_chunk(disk, chunk, chunk_offset, out, n) == -1) {
+            return -1;
+        }
+
+        out += n;
+        offset += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+int compressed_disk_close(struct compressed_disk_t* disk) {
+    if (disk == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    for (int i = 0; i < COMPRESSED_DISK_CACHE_SIZE; i++) {
+        free(disk->cache[i].data);
+    }
+    pthread_mutex_destroy(&disk->cache_lock);
+    free(disk->index);
+    free(disk);
+
+    return 0;
+}
+
+// Writes `image_file_name` as a chunk-compressed image. `chunk_size` must be a
+// multiple of the sector size up to COMPRESSED_DISK_MAX_CHUNK_SIZE, 0 picks
+// COMPRESSED_DISK_CHUNK_SIZE. The output is removed if anything fails.
+int compressed_disk_convert(const char* image_file_name, const char* output_file_name,
+                            uint32_t chunk_size) {
+    if (image_file_name == NULL || output_file_name == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if (chunk_size == 0) chunk_size = COMPRESSED_DISK_CHUNK_SIZE;
+    if (chunk_size > COMPRESSED_DISK_MAX_CHUNK_SIZE || chunk_size % MIN_BYTES_PER_SECTOR != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    FILE* in = fopen(image_file_name, "r");
+    if (in == NULL) {
+        return -1;
+    }
+
+    FILE* out = fopen(output_file_name, "w");
+    if (out == NULL) {
+        fclose(in);
+        return -1;
+    }
+
+    fseek(in, 0, SEEK_END);
+    uint64_t image_size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+
+    struct compressed_header_t header;
+    memcpy(header.magic, COMPRESSED_DISK_MAGIC, sizeof(header.magic));
+    header.chunk_size = chunk_size;
+    header.chunks_n = (image_size + chunk_size - 1) / chunk_size;
+    header.image_size = image_size;
+
+    size_t index_size = (size_t)header.chunks_n * sizeof(struct chunk_index_t);
+    struct chunk_index_t* index = calloc(header.chunks_n > 0 ? header.chunks_n : 1,
+                                         sizeof(struct chunk_index_t));
+    uint8_t* chunk = malloc(chunk_size);
+    uLongf bound = compressBound(chunk_size);
+    uint8_t* compressed = malloc(bound);
+
+    if (index == NULL || chunk == NULL || compressed == NULL) {
+        errno = ENOMEM;
+        goto error;
+    }
+
+    // Chunk data goes after the index, which is written last
+    uint64_t data_offset = sizeof(header) + index_size;
+    if (fseek(out, data_offset, SEEK_SET) != 0) goto error;
+
+    for (uint32_t i = 0; i < header.chunks_n; i++) {
+        uint64_t left = image_size - (uint64_t)i * chunk_size;
+        uint32_t length = left < chunk_size ? (uint32_t)left : chunk_size;
+
+        if (fread(chunk, 1, length, in) != length) {
+            errno = EIO;
+            goto error;
+        }
+
+        bool zero = true;
+        for (uint32_t j = 0; j < length && zero; j++) {
+            zero = chunk[j] == 0;
+        }
+
+        index[i].offset = data_offset;
+
+        if (zero) {
+            index[i].type = CHUNK_ZERO;
+            index[i].length = 0;
+            continue;
+        }
+
+        uLongf compressed_len = bound;
+        const uint8_t* data = compressed;
+        if (compress(compressed, &compressed_len, chunk, length) == Z_OK &&
+            compressed_len < length) {
+            index[i].type = CHUNK_ZLIB;
+        } else {
+            index[i].type = CHUNK_RAW;
+            compressed_len = length;
+            data = chunk;
+        }
+
+        index[i].length = compressed_len;
+        if (fwrite(data, 1, compressed_len, out) != compressed_len) {
+            errno = EIO;
+            goto error;
+        }
+        data_offset += compressed_len;
+    }
+
+    if (fseek(out, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, out) != 1 ||
+        fwrite(index, 1, index_size, out) != index_size) {
+        errno = EIO;
+        goto error;
+    }
+
+    free(index);
+    free(chunk);
+    free(compressed);
+    fclose(in);
+
+    if (fclose(out) != 0) {
+        unlink(output_file_name);
+        return -1;
+    }
+
+    return 0;
+
+error:
+    free(index);
+    free(chunk);
+    free(compressed);
+    fclose(in);
+    fclose(out);
+    // Don't leave a truncated image behind that looks like a valid one
+    unlink(output_file_name);
+    return -1;
+}
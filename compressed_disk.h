@@ -0,0 +1,67 @@
+#ifndef COMPRESSED_DISK_H
+#define COMPRESSED_DISK_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define COMPRESSED_DISK_MAGIC "FAT16CZ1"
+#define COMPRESSED_DISK_CHUNK_SIZE (64 * 1024)
+// Chunks are decompressed into buffers of this size at most, larger ones in
+// a header are taken as corruption
+#define COMPRESSED_DISK_MAX_CHUNK_SIZE (16 * 1024 * 1024)
+// Number of decompressed chunks kept per disk
+#define COMPRESSED_DISK_CACHE_SIZE 8
+
+enum chunk_type_t {
+    // All zero, nothing is stored
+    CHUNK_ZERO = 0,
+    CHUNK_ZLIB = 1,
+    // Stored as is because it didn't compress
+    CHUNK_RAW = 2,
+};
+
+// File layout: header, index with one entry per chunk, chunk data
+struct compressed_header_t {
+    uint8_t magic[8];
+    uint32_t chunk_size;
+    uint32_t chunks_n;
+    uint64_t image_size;
+} __attribute__((packed));
+
+struct chunk_index_t {
+    uint64_t offset;
+    uint32_t length;
+    uint32_t type;
+} __attribute__((packed));
+
+struct chunk_cache_t {
+    uint32_t chunk;
+    uint64_t last_used;
+    uint8_t* data;
+};
+
+struct compressed_disk_t {
+    int fd;
+    uint32_t chunk_size;
+    uint32_t chunks_n;
+    uint64_t image_size;
+    struct chunk_index_t* index;
+
+    pthread_mutex_t cache_lock;
+    struct chunk_cache_t cache[COMPRESSED_DISK_CACHE_SIZE];
+    uint64_t cache_clock;
+};
+
+bool compressed_disk_detect(FILE* fd);
+struct compressed_disk_t* compressed_disk_open(FILE* fd);
+int compressed_disk_read(struct compressed_disk_t* disk, uint64_t offset, void* buffer,
+                         size_t len);
+int compressed_disk_close(struct compressed_disk_t* disk);
+
+int compressed_disk_convert(const char* image_file_name, const char* output_file_name,
+                            uint32_t chunk_size);
+
+#endif  // COMPRESSED_DISK_H
@@ -0,0 +1,758 @@
+#include "diff.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct diff_node_t {
+    char* path;
+    struct root_entry_t entry;
+    // Set once the node is paired with one on the other volume
+    bool matched;
+};
+
+struct diff_tree_t {
+    struct diff_node_t* nodes;
+    size_t nodes_n;
+    size_t capacity;
+};
+
+struct diff_job_t {
+    struct volume_t* old_volume;
+    struct volume_t* new_volume;
+    struct diff_tree_t old_tree;
+    struct diff_tree_t new_tree;
+    struct diff_entry_t* entries;
+    size_t entries_n;
+    size_t capacity;
+    struct diff_stats_t stats;
+    // At least DIFF_CHUNK_SIZE and one cluster of either volume
+    size_t buf_size;
+    uint8_t* old_buf;
+    uint8_t* new_buf;
+};
+
+int collect_node(const char* path, struct root_entry_t* entry, void* arg) {
+    struct diff_tree_t* tree = arg;
+
+    if (tree->nodes_n == tree->capacity) {
+        size_t new_capacity = tree->capacity == 0 ? 64 : tree->capacity * 2;
+
+        struct diff_node_t* new_nodes =
+            realloc(tree->nodes, new_capacity * sizeof(struct diff_node_t));
+        if (new_nodes == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        tree->nodes = new_nodes;
+        tree->capacity = new_capacity;
+    }
+
+    struct diff_node_t* node = &tree->nodes[tree->nodes_n];
+    node->path = strdup(path);
+    if (node->path == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    node->entry = *entry;
+    node->matched = false;
+    tree->nodes_n++;
+
+    return 0;
+}
+
+void free_tree(struct diff_tree_t* tree) {
+    for (size_t i = 0; i < tree->nodes_n; i++) {
+        free(tree->nodes[i].path);
+    }
+    free(tree->nodes);
+}
+
+int compare_diff_nodes(const void* a, const void* b) {
+    const struct diff_node_t* left = a;
+    const struct diff_node_t* right = b;
+
+    return strcmp(left->path, right->path);
+}
+
+bool is_dir(const struct root_entry_t* entry) {
+    return (entry->attributes >> 4) & 1;
+}
+
+// Everything but the name and the last access date, which changes on reads
+bool same_metadata(const struct root_entry_t* a, const struct root_entry_t* b,
+                   bool with_cluster) {
+    return a->attributes == b->attributes && a->creation_time == b->creation_time &&
+           a->creation_date == b->creation_date && a->mod_time == b->mod_time &&
+           a->mod_date == b->mod_date && a->size == b->size &&
+           (!with_cluster || a->first_cluster == b->first_cluster);
+}
+
+bool same_geometry(struct volume_t* a, struct volume_t* b) {
+    return a->bytes_per_sector == b->bytes_per_sector &&
+           a->sectors_per_cluster == b->sectors_per_cluster && a->data_start == b->data_start;
+}
+
+uint32_t clusters_for(struct volume_t* pvolume, uint32_t size) {
+    return (uint32_t)(((uint64_t)size + pvolume->bytes_per_cluster - 1) >> pvolume->cluster_shift);
+}
+
+// Collects at most `needed` clusters of a chain, fewer if it is broken
+uint16_t* file_chain(struct volume_t* pvolume, uint16_t first_cluster, uint32_t needed,
+                     uint32_t* chain_n) {
+    uint16_t* chain = malloc((needed > 0 ? needed : 1) * sizeof(uint16_t));
+    if (chain == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    uint32_t n = 0;
+    uint16_t cluster = first_cluster;
+    while (n < needed && cluster >= 2 && cluster < pvolume->clusters_n) {
+        chain[n++] = cluster;
+        cluster = pvolume->fat[cluster];
+    }
+
+    *chain_n = n;
+
+    return chain;
+}
+
+// Both FATs are in memory, so comparing chains costs no I/O
+bool same_chain(struct diff_job_t* job, uint16_t first_cluster, uint32_t size) {
+    uint32_t needed = clusters_for(job->old_volume, size);
+    uint16_t old_cluster = first_cluster;
+    uint16_t new_cluster = first_cluster;
+
+    for (uint32_t i = 0; i < needed; i++) {
+        if (old_cluster != new_cluster) return false;
+        if (old_cluster < 2 || old_cluster >= job->old_volume->clusters_n ||
+            new_cluster >= job->new_volume->clusters_n) {
+            return true;
+        }
+
+        old_cluster = job->old_volume->fat[old_cluster];
+        new_cluster = job->new_volume->fat[new_cluster];
+    }
+
+    return true;
+}
+
+// Fallback for volumes with different cluster layouts, where clusters can't
+// be paired up
+int compare_streams(struct diff_job_t* job, struct root_entry_t* old_entry,
+                    struct root_entry_t* new_entry, bool* differ) {
+    struct file_t* old_file = file_open_entry(job->old_volume, old_entry);
+    if (old_file == NULL) {
+        return -1;
+    }
+
+    struct file_t* new_file = file_open_entry(job->new_volume, new_entry);
+    if (new_file == NULL) {
+        file_close(old_file);
+        return -1;
+    }
+
+    *differ = false;
+
+    while (true) {
+        size_t old_n = file_read(job->old_buf, 1, DIFF_CHUNK_SIZE, old_file);
+        size_t new_n = file_read(job->new_buf, 1, DIFF_CHUNK_SIZE, new_file);
+
+        // A read error is not a difference, let diff_volumes report it
+        if (old_n == (size_t)-1 || new_n == (size_t)-1) {
+            file_close(new_file);
+            file_close(old_file);
+            return -1;
+        }
+
+        if (old_n != new_n || memcmp(job->old_buf, job->new_buf, old_n) != 0) {
+            *differ = true;
+            break;
+        }
+        if (old_n < DIFF_CHUNK_SIZE) break;
+    }
+
+    file_close(new_file);
+    file_close(old_file);
+
+    return 0;
+}
+
+// Compares two files of the same size cluster by cluster. With
+// `skip_shared`, clusters that sit at the same place in both chains are
+// taken to be unchanged and never read.
+int compare_contents(struct diff_job_t* job, struct root_entry_t* old_entry,
+                     struct root_entry_t* new_entry, bool skip_shared, bool* differ) {
+    struct volume_t* old_volume = job->old_volume;
+    struct volume_t* new_volume = job->new_volume;
+
+    if (!same_geometry(old_volume, new_volume)) {
+        return compare_streams(job, old_entry, new_entry, differ);
+    }
+
+    uint32_t needed = clusters_for(old_volume, old_entry->size);
+    uint32_t old_n, new_n;
+
+    uint16_t* old_chain = file_chain(old_volume, old_entry->first_cluster, needed, &old_n);
+    if (old_chain == NULL) {
+        return -1;
+    }
+
+    uint16_t* new_chain = file_chain(new_volume, new_entry->first_cluster, needed, &new_n);
+    if (new_chain == NULL) {
+        free(old_chain);
+        return -1;
+    }
+
+    uint8_t cluster_shift = old_volume->cluster_shift;
+    uint32_t max_run = job->buf_size >> cluster_shift;
+    int result = 0;
+
+    // A broken chain can't be compared in full, so count it as a change
+    *differ = old_n < needed || new_n < needed;
+
+    for (uint32_t i = 0; i < needed && !*differ;) {
+        if (skip_shared && old_chain[i] == new_chain[i]) {
+            job->stats.clusters_skipped++;
+            i++;
+            continue;
+        }
+
+        // Grow the run while both chains stay contiguous on disk
+        uint32_t run = 1;
+        while (i + run < needed && run < max_run &&
+               old_chain[i + run] == old_chain[i] + run &&
+               new_chain[i + run] == new_chain[i] + run &&
+               !(skip_shared && old_chain[i + run] == new_chain[i + run])) {
+            run++;
+        }
+
+        uint32_t sectors = run << old_volume->cluster_sectors_shift;
+        uint32_t old_sector = cluster_sector(old_volume, old_chain[i]);
+        uint32_t new_sector = cluster_sector(new_volume, new_chain[i]);
+
+        if (volume_read(old_volume, old_sector, job->old_buf, sectors) == -1 ||
+            volume_read(new_volume, new_sector, job->new_buf, sectors) == -1) {
+            result = -1;
+            break;
+        }
+
+        // The last cluster is only compared up to the end of the file
+        uint64_t offset = (uint64_t)i << cluster_shift;
+        uint64_t n = (uint64_t)run << cluster_shift;
+        if (offset + n > old_entry->size) n = old_entry->size - offset;
+
+        *differ = memcmp(job->old_buf, job->new_buf, n) != 0;
+
+        job->stats.clusters_compared += run;
+        i += run;
+    }
+
+    free(new_chain);
+    free(old_chain);
+
+    return result;
+}
+
+int add_entry(struct diff_job_t* job, enum diff_kind_t kind, struct diff_node_t* old_node,
+              struct diff_node_t* new_node, bool content_changed) {
+    if (job->entries_n == job->capacity) {
+        size_t new_capacity = job->capacity == 0 ? 16 : job->capacity * 2;
+
+        struct diff_entry_t* new_entries =
+            realloc(job->entries, new_capacity * sizeof(struct diff_entry_t));
+        if (new_entries == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        job->entries = new_entries;
+        job->capacity = new_capacity;
+    }
+
+    struct diff_entry_t* entry = &job->entries[job->entries_n];
+    memset(entry, 0, sizeof(struct diff_entry_t));
+    entry->kind = kind;
+    entry->content_changed = content_changed;
+    entry->is_directory = is_dir(old_node != NULL ? &old_node->entry : &new_node->entry);
+
+    if (old_node != NULL && (entry->old_path = strdup(old_node->path)) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (new_node != NULL && (entry->new_path = strdup(new_node->path)) == NULL) {
+        free(entry->old_path);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    job->entries_n++;
+
+    return 0;
+}
+
+// Pairs up entries found under the same path on both volumes
+int diff_matching(struct diff_job_t* job) {
+    struct diff_tree_t* old_tree = &job->old_tree;
+    struct diff_tree_t* new_tree = &job->new_tree;
+    size_t i = 0;
+    size_t j = 0;
+    // Cluster numbers only mean the same data when both volumes share a layout
+    bool same_layout = same_geometry(job->old_volume, job->new_volume);
+
+    while (i < old_tree->nodes_n && j < new_tree->nodes_n) {
+        struct diff_node_t* old_node = &old_tree->nodes[i];
+        struct diff_node_t* new_node = &new_tree->nodes[j];
+
+        int order = strcmp(old_node->path, new_node->path);
+        if (order < 0) {
+            i++;
+            continue;
+        }
+        if (order > 0) {
+            j++;
+            continue;
+        }
+
+        i++;
+        j++;
+        job->stats.entries_compared++;
+
+        struct root_entry_t* old_entry = &old_node->entry;
+        struct root_entry_t* new_entry = &new_node->entry;
+
+        // A file replaced by a directory or the other way round is reported
+        // as removed and added
+        if (is_dir(old_entry) != is_dir(new_entry)) continue;
+
+        old_node->matched = true;
+        new_node->matched = true;
+
+        // Changes inside a directory show up on its children
+        if (is_dir(old_entry)) continue;
+
+        if (same_layout && same_metadata(old_entry, new_entry, true) &&
+            same_chain(job, old_entry->first_cluster, old_entry->size)) {
+            job->stats.clusters_skipped += clusters_for(job->old_volume, old_entry->size);
+            continue;
+        }
+
+        bool content_changed = old_entry->size != new_entry->size;
+        if (!content_changed) {
+            // Unchanged times mean the data wasn't rewritten in place, so
+            // only clusters that moved need a look
+            bool skip_shared = same_layout && old_entry->mod_time == new_entry->mod_time &&
+                               old_entry->mod_date == new_entry->mod_date;
+
+            if (compare_contents(job, old_entry, new_entry, skip_shared, &content_changed) ==
+                -1) {
+                return -1;
+            }
+        }
+
+        if (content_changed || !same_metadata(old_entry, new_entry, false)) {
+            if (add_entry(job, DIFF_MODIFIED, old_node, new_node, content_changed) == -1) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int compare_move_keys(const struct root_entry_t* a, const struct root_entry_t* b) {
+    if (is_dir(a) != is_dir(b)) return is_dir(a) ? 1 : -1;
+    if (a->first_cluster != b->first_cluster) return a->first_cluster < b->first_cluster ? -1 : 1;
+    if (a->size != b->size) return a->size < b->size ? -1 : 1;
+    return 0;
+}
+
+int compare_candidates(const void* a, const void* b) {
+    const struct diff_node_t* left = *(const struct diff_node_t* const*)a;
+    const struct diff_node_t* right = *(const struct diff_node_t* const*)b;
+
+    return compare_move_keys(&left->entry, &right->entry);
+}
+
+// Unmatched entries on both sides that start at the same cluster and have
+// the same size and contents are moves. Renamed files keep their chain, so
+// their contents are usually settled without reading anything.
+int diff_moves(struct diff_job_t* job) {
+    struct diff_tree_t* old_tree = &job->old_tree;
+    struct diff_tree_t* new_tree = &job->new_tree;
+
+    struct diff_node_t** candidates =
+        malloc((old_tree->nodes_n > 0 ? old_tree->nodes_n : 1) * sizeof(struct diff_node_t*));
+    if (candidates == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    size_t candidates_n = 0;
+    for (size_t i = 0; i < old_tree->nodes_n; i++) {
+        // Empty files all start at cluster 0 and can't be told apart
+        if (!old_tree->nodes[i].matched && old_tree->nodes[i].entry.first_cluster != 0) {
+            candidates[candidates_n++] = &old_tree->nodes[i];
+        }
+    }
+
+    qsort(candidates, candidates_n, sizeof(struct diff_node_t*), compare_candidates);
+
+    for (size_t j = 0; j < new_tree->nodes_n; j++) {
+        struct diff_node_t* new_node = &new_tree->nodes[j];
+        if (new_node->matched || new_node->entry.first_cluster == 0) continue;
+
+        // First candidate with the same key
+        size_t low = 0;
+        size_t high = candidates_n;
+        while (low < high) {
+            size_t middle = low + (high - low) / 2;
+            if (compare_move_keys(&candidates[middle]->entry, &new_node->entry) < 0) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+
+        for (size_t k = low; k < candidates_n; k++) {
+            struct diff_node_t* old_node = candidates[k];
+            if (compare_move_keys(&old_node->entry, &new_node->entry) != 0) break;
+            if (old_node->matched) continue;
+
+            bool differ = false;
+            if (!is_dir(&old_node->entry)) {
+                bool skip_shared = same_geometry(job->old_volume, job->new_volume) &&
+                                   same_metadata(&old_node->entry, &new_node->entry, true);
+                if (compare_contents(job, &old_node->entry, &new_node->entry, skip_shared,
+                                     &differ) == -1) {
+                    free(candidates);
+                    return -1;
+                }
+            }
+            if (differ) continue;
+
+            old_node->matched = true;
+            new_node->matched = true;
+
+            if (add_entry(job, DIFF_MOVED, old_node, new_node, false) == -1) {
+                free(candidates);
+                return -1;
+            }
+            break;
+        }
+    }
+
+    free(candidates);
+
+    return 0;
+}
+
+int compare_moved_dirs(const void* a, const void* b) {
+    const struct diff_entry_t* left = *(const struct diff_entry_t* const*)a;
+    const struct diff_entry_t* right = *(const struct diff_entry_t* const*)b;
+
+    return strcmp(left->old_path, right->old_path);
+}
+
+int compare_new_paths(const void* a, const void* b) {
+    const struct diff_entry_t* left = a;
+    const struct diff_entry_t* right = b;
+
+    return strcmp(left->new_path, right->new_path);
+}
+
+// Entries that have no cluster to key on, like empty files, are moves when
+// their directory moved and they are still there under the same name
+int diff_moved_children(struct diff_job_t* job) {
+    // Copies, adding entries may move the originals
+    struct diff_entry_t* dirs =
+        malloc((job->entries_n > 0 ? job->entries_n : 1) * sizeof(struct diff_entry_t));
+    if (dirs == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    size_t dirs_n = 0;
+    for (size_t i = 0; i < job->entries_n; i++) {
+        if (job->entries[i].kind == DIFF_MOVED && job->entries[i].is_directory) {
+            dirs[dirs_n++] = job->entries[i];
+        }
+    }
+
+    qsort(dirs, dirs_n, sizeof(struct diff_entry_t), compare_new_paths);
+
+    struct diff_tree_t* old_tree = &job->old_tree;
+    struct diff_tree_t* new_tree = &job->new_tree;
+    int result = 0;
+
+    // Nodes are sorted by path, so a directory is matched before its children
+    for (size_t j = 0; j < new_tree->nodes_n && dirs_n > 0; j++) {
+        struct diff_node_t* new_node = &new_tree->nodes[j];
+        if (new_node->matched) continue;
+
+        const char* name = strrchr(new_node->path, '\\');
+        size_t parent_len = name - new_node->path;
+
+        char parent[parent_len + 1];
+        memcpy(parent, new_node->path, parent_len);
+        parent[parent_len] = '\0';
+
+        struct diff_entry_t key = {.new_path = parent};
+        struct diff_entry_t* dir =
+            bsearch(&key, dirs, dirs_n, sizeof(struct diff_entry_t), compare_new_paths);
+        if (dir == NULL) continue;
+
+        char old_path[strlen(dir->old_path) + strlen(name) + 1];
+        strcpy(old_path, dir->old_path);
+        strcat(old_path, name);
+
+        struct diff_node_t node_key = {.path = old_path};
+        struct diff_node_t* old_node = bsearch(&node_key, old_tree->nodes, old_tree->nodes_n,
+                                               sizeof(struct diff_node_t), compare_diff_nodes);
+        if (old_node == NULL || old_node->matched ||
+            is_dir(&old_node->entry) != is_dir(&new_node->entry) ||
+            old_node->entry.size != new_node->entry.size) {
+            continue;
+        }
+
+        bool differ = false;
+        if (!is_dir(&old_node->entry)) {
+            bool skip_shared = same_geometry(job->old_volume, job->new_volume) &&
+                               same_metadata(&old_node->entry, &new_node->entry, true);
+            if (compare_contents(job, &old_node->entry, &new_node->entry, skip_shared,
+                                 &differ) == -1) {
+                result = -1;
+                break;
+            }
+        }
+        if (differ) continue;
+
+        old_node->matched = true;
+        new_node->matched = true;
+
+        if (add_entry(job, DIFF_MOVED, old_node, new_node, false) == -1) {
+            result = -1;
+            break;
+        }
+    }
+
+    free(dirs);
+
+    return result;
+}
+
+// Whether a move is already implied by its parent directory moving
+bool move_is_implied(struct diff_entry_t* entry, struct diff_entry_t** dirs, size_t dirs_n) {
+    const char* old_name = strrchr(entry->old_path, '\\');
+    const char* new_name = strrchr(entry->new_path, '\\');
+    if (old_name == NULL || new_name == NULL || strcmp(old_name, new_name) != 0) return false;
+
+    size_t old_parent_len = old_name - entry->old_path;
+    size_t new_parent_len = new_name - entry->new_path;
+    if (old_parent_len == 0) return false;
+
+    char old_parent[old_parent_len + 1];
+    memcpy(old_parent, entry->old_path, old_parent_len);
+    old_parent[old_parent_len] = '\0';
+
+    struct diff_entry_t key = {.old_path = old_parent};
+    struct diff_entry_t* key_ptr = &key;
+    struct diff_entry_t** found =
+        bsearch(&key_ptr, dirs, dirs_n, sizeof(struct diff_entry_t*), compare_moved_dirs);
+    if (found == NULL) return false;
+
+    return strlen((*found)->new_path) == new_parent_len &&
+           memcmp((*found)->new_path, entry->new_path, new_parent_len) == 0;
+}
+
+// Drops the moves of everything below a moved directory, the directory
+// itself says it all
+int prune_moves(struct diff_job_t* job) {
+    struct diff_entry_t** dirs =
+        malloc((job->entries_n > 0 ? job->entries_n : 1) * sizeof(struct diff_entry_t*));
+    if (dirs == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    size_t dirs_n = 0;
+    for (size_t i = 0; i < job->entries_n; i++) {
+        if (job->entries[i].kind == DIFF_MOVED && job->entries[i].is_directory) {
+            dirs[dirs_n++] = &job->entries[i];
+        }
+    }
+
+    qsort(dirs, dirs_n, sizeof(struct diff_entry_t*), compare_moved_dirs);
+
+    // Decide first and compact afterwards, `dirs` points into the entries
+    bool* implied = calloc(job->entries_n > 0 ? job->entries_n : 1, sizeof(bool));
+    if (implied == NULL) {
+        free(dirs);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (size_t i = 0; i < job->entries_n; i++) {
+        if (job->entries[i].kind == DIFF_MOVED) {
+            implied[i] = move_is_implied(&job->entries[i], dirs, dirs_n);
+        }
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < job->entries_n; i++) {
+        if (implied[i]) {
+            free(job->entries[i].old_path);
+            free(job->entries[i].new_path);
+            continue;
+        }
+        job->entries[kept++] = job->entries[i];
+    }
+    job->entries_n = kept;
+
+    free(implied);
+    free(dirs);
+
+    return 0;
+}
+
+const char* entry_path(const struct diff_entry_t* entry) {
+    return entry->new_path != NULL ? entry->new_path : entry->old_path;
+}
+
+int compare_entries(const void* a, const void* b) {
+    const struct diff_entry_t* left = a;
+    const struct diff_entry_t* right = b;
+
+    int order = strcmp(entry_path(left), entry_path(right));
+    if (order != 0) return order;
+
+    return (int)left->kind - (int)right->kind;
+}
+
+// Lists what changed from `old_volume` to `new_volume`. Directory trees are
+// compared by their entries first, file contents are only read where the
+// entries or the cluster chains differ. Entries are sorted by path and must
+// be freed with `diff_free`.
+int diff_volumes(struct volume_t* old_volume, struct volume_t* new_volume,
+                 struct diff_entry_t** entries, size_t* entries_n, struct diff_stats_t* stats) {
+    if (old_volume == NULL || new_volume == NULL || entries == NULL || entries_n == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    struct diff_job_t job = {
+        .old_volume = old_volume,
+        .new_volume = new_volume,
+    };
+
+    job.buf_size = DIFF_CHUNK_SIZE;
+    if (old_volume->bytes_per_cluster > job.buf_size) job.buf_size = old_volume->bytes_per_cluster;
+    if (new_volume->bytes_per_cluster > job.buf_size) job.buf_size = new_volume->bytes_per_cluster;
+
+    job.old_buf = malloc(job.buf_size);
+    job.new_buf = malloc(job.buf_size);
+    if (job.old_buf == NULL || job.new_buf == NULL) {
+        errno = ENOMEM;
+        goto error;
+    }
+
+    if (volume_walk(old_volume, collect_node, &job.old_tree) != 0 ||
+        volume_walk(new_volume, collect_node, &job.new_tree) != 0) {
+        goto error;
+    }
+
+    if (job.old_tree.nodes_n > 0) {
+        qsort(job.old_tree.nodes, job.old_tree.nodes_n, sizeof(struct diff_node_t),
+              compare_diff_nodes);
+    }
+    if (job.new_tree.nodes_n > 0) {
+        qsort(job.new_tree.nodes, job.new_tree.nodes_n, sizeof(struct diff_node_t),
+              compare_diff_nodes);
+    }
+
+    if (diff_matching(&job) == -1 || diff_moves(&job) == -1 || diff_moved_children(&job) == -1 ||
+        prune_moves(&job) == -1) {
+        goto error;
+    }
+
+    for (size_t i = 0; i < job.old_tree.nodes_n; i++) {
+        if (!job.old_tree.nodes[i].matched &&
+            add_entry(&job, DIFF_REMOVED, &job.old_tree.nodes[i], NULL, false) == -1) {
+            goto error;
+        }
+    }
+    for (size_t i = 0; i < job.new_tree.nodes_n; i++) {
+        if (!job.new_tree.nodes[i].matched &&
+            add_entry(&job, DIFF_ADDED, NULL, &job.new_tree.nodes[i], false) == -1) {
+            goto error;
+        }
+    }
+
+    if (job.entries_n > 0) {
+        qsort(job.entries, job.entries_n, sizeof(struct diff_entry_t), compare_entries);
+    }
+
+    free_tree(&job.old_tree);
+    free_tree(&job.new_tree);
+    free(job.old_buf);
+    free(job.new_buf);
+
+    *entries = job.entries;
+    *entries_n = job.entries_n;
+    if (stats != NULL) *stats = job.stats;
+
+    return 0;
+
+error:
+    diff_free(job.entries, job.entries_n);
+    free_tree(&job.old_tree);
+    free_tree(&job.new_tree);
+    free(job.old_buf);
+    free(job.new_buf);
+
+    return -1;
+}
+
+// One line per change: "A", "D", "M" or "R" and the path, with both paths for
+// moves. Entries whose contents are the same but whose attributes or times
+// changed are marked "m".
+int diff_print(FILE* out, struct diff_entry_t* entries, size_t entries_n) {
+    if (out == NULL || (entries == NULL && entries_n > 0)) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    for (size_t i = 0; i < entries_n; i++) {
+        struct diff_entry_t* entry = &entries[i];
+        const char* suffix = entry->is_directory ? "\\" : "";
+
+        switch (entry->kind) {
+            case DIFF_ADDED:
+                fprintf(out, "A %s%s\n", entry->new_path, suffix);
+                break;
+            case DIFF_REMOVED:
+                fprintf(out, "D %s%s\n", entry->old_path, suffix);
+                break;
+            case DIFF_MODIFIED:
+                fprintf(out, "%c %s%s\n", entry->content_changed ? 'M' : 'm', entry->new_path,
+                        suffix);
+                break;
+            case DIFF_MOVED:
+                fprintf(out, "R %s%s -> %s%s\n", entry->old_path, suffix, entry->new_path,
+                        suffix);
+                break;
+        }
+    }
+
+    return ferror(out) ? -1 : 0;
+}
+
+void diff_free(struct diff_entry_t* entries, size_t entries_n) {
+    if (entries == NULL) return;
+
+    for (size_t i = 0; i < entries_n; i++) {
+        free(entries[i].old_path);
+        free(entries[i].new_path);
+    }
+    free(entries);
+}
@@ -0,0 +1,45 @@
+#ifndef DIFF_H
+#define DIFF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "file_reader.h"
+
+// Clusters that differ are read and compared in runs of up to this size
+#define DIFF_CHUNK_SIZE (256 * 1024)
+
+enum diff_kind_t {
+    DIFF_ADDED,
+    DIFF_REMOVED,
+    DIFF_MODIFIED,
+    DIFF_MOVED,
+};
+
+struct diff_entry_t {
+    enum diff_kind_t kind;
+    // Path on the old volume, NULL for added files
+    char* old_path;
+    // Path on the new volume, NULL for removed files
+    char* new_path;
+    bool is_directory;
+    // Only set for DIFF_MODIFIED, false when just the entry metadata changed
+    bool content_changed;
+};
+
+struct diff_stats_t {
+    size_t entries_compared;
+    // Clusters read from each volume and compared byte by byte
+    size_t clusters_compared;
+    // Clusters shared by both versions of an unchanged file, never read
+    size_t clusters_skipped;
+};
+
+int diff_volumes(struct volume_t* old_volume, struct volume_t* new_volume,
+                 struct diff_entry_t** entries, size_t* entries_n, struct diff_stats_t* stats);
+int diff_print(FILE* out, struct diff_entry_t* entries, size_t entries_n);
+void diff_free(struct diff_entry_t* entries, size_t entries_n);
+
+#endif  // DIFF_H
@@ -2,9 +2,38 @@
 
 #include <byteswap.h>
 #include <errno.h>
+#include <limits.h>
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "compressed_disk.h"
+#include "sidecar.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// Writes the "NAME.EXT" form of an 8.3 name to `out`, which must hold 13 bytes
+void format_short_name(const uint8_t* name, const uint8_t* ext, char* out) {
+    uint8_t n = 0;
+
+    for (uint8_t i = 0; i < 8 && name[i] != ' '; i++) {
+        out[n++] = name[i];
+    }
+
+    // No dot if there is no extension
+    if (ext[0] != ' ') {
+        out[n++] = '.';
+        for (uint8_t i = 0; i < 3 && ext[i] != ' '; i++) {
+            out[n++] = ext[i];
+        }
+    }
+
+    out[n] = '\0';
+}
 
 uint8_t* clean_file_name(uint8_t* name, uint8_t* ext) {
     if (name == NULL || ext == NULL) {
@@ -16,32 +45,7 @@ uint8_t* clean_file_name(uint8_t* name, uint8_t* ext) {
         return NULL;
     }
 
-    memcpy(out, name, 8);
-
-    uint8_t name_end = 8;
-    for (uint8_t i = 0; i < name_end; i++) {
-        if (out[i] == ' ') {
-            name_end = i;
-            break;
-        }
-    }
-
-    // End here if no extension
-    if (ext[0] == ' ') {
-        out[name_end] = '\0';
-        return out;
-    }
-
-    out[name_end] = '.';
-    name_end++;
-
-    memcpy(out + name_end, ext, 3);
-    for (; name_end < 13; name_end++) {
-        if (out[name_end] == ' ') {
-            out[name_end] = '\0';
-            break;
-        }
-    }
+    format_short_name(name, ext, (char*)out);
 
     return out;
 }
@@ -85,11 +89,33 @@ struct disk_t* disk_open_from_file(const char* volume_file_name) {
         return NULL;
     }
     disk->fd = fd;
+    disk->compressed = NULL;
 
-    fseek(fd, 0, SEEK_END);
-    disk->file_len = ftell(fd);
-    disk->sectors = disk->file_len / BYTES_PER_SECTOR;
-    fseek(fd, 0, SEEK_SET);
+    disk->file_name = strdup(volume_file_name);
+    if (disk->file_name == NULL) {
+        fclose(fd);
+        free(disk);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (compressed_disk_detect(fd)) {
+        disk->compressed = compressed_disk_open(fd);
+        if (disk->compressed == NULL) {
+            fclose(fd);
+            free(disk->file_name);
+            free(disk);
+            return NULL;
+        }
+        disk->file_len = disk->compressed->image_size;
+    } else {
+        fseek(fd, 0, SEEK_END);
+        disk->file_len = ftell(fd);
+        fseek(fd, 0, SEEK_SET);
+    }
+    // Images past 2 TiB can't be addressed with 32-bit sector numbers anyway
+    uint64_t sectors = disk->file_len / DISK_SECTOR_SIZE;
+    disk->sectors = sectors > UINT32_MAX ? UINT32_MAX : (uint32_t)sectors;
 
     return disk;
 }
@@ -101,57 +127,135 @@ int disk_read(struct disk_t* pdisk, int32_t first_sector, void* buffer,
         return -1;
     }
 
-    int first_byte = first_sector * BYTES_PER_SECTOR;
+    uint64_t first_byte = (uint64_t)first_sector * DISK_SECTOR_SIZE;
 
-    if ((uint32_t)(first_sector + sectors_to_read) > pdisk->sectors) {
+    if (first_sector < 0 || sectors_to_read < 0 ||
+        (uint64_t)first_sector + (uint64_t)sectors_to_read > pdisk->sectors) {
         errno = ERANGE;
         return -1;
     }
 
-    fseek(pdisk->fd, first_byte, SEEK_SET);
-    fread(buffer, BYTES_PER_SECTOR, sectors_to_read, pdisk->fd);
-    fseek(pdisk->fd, 0, SEEK_SET);
+    size_t bytes_to_read = (size_t)sectors_to_read * DISK_SECTOR_SIZE;
+
+    if (pdisk->compressed != NULL) {
+        if (compressed_disk_read(pdisk->compressed, first_byte, buffer, bytes_to_read) == -1) {
+            return -1;
+        }
+        return sectors_to_read;
+    }
+
+    // pread doesn't move a shared file position, so volumes on the same disk
+    // can be read from several threads at once
+    if (pread(fileno(pdisk->fd), buffer, bytes_to_read, first_byte) !=
+        (ssize_t)bytes_to_read) {
+        errno = EIO;
+        return -1;
+    }
 
     return sectors_to_read;
 }
 
+// Reads bytes straight into a set of buffers with a single preadv call
+int disk_preadv(struct disk_t* pdisk, uint64_t offset, const struct iovec* iov,
+                int iovcnt) {
+    size_t bytes_to_read = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        bytes_to_read += iov[i].iov_len;
+    }
+
+    if (offset + bytes_to_read > (uint64_t)pdisk->sectors * DISK_SECTOR_SIZE) {
+        errno = ERANGE;
+        return -1;
+    }
+
+    // Compressed images are read buffer by buffer through the chunk cache
+    if (pdisk->compressed != NULL) {
+        for (int i = 0; i < iovcnt; i++) {
+            if (compressed_disk_read(pdisk->compressed, offset, iov[i].iov_base,
+                                     iov[i].iov_len) == -1) {
+                return -1;
+            }
+            offset += iov[i].iov_len;
+        }
+        return 0;
+    }
+
+    if (preadv(fileno(pdisk->fd), iov, iovcnt, offset) != (ssize_t)bytes_to_read) {
+        errno = EIO;
+        return -1;
+    }
+
+    return 0;
+}
+
 int disk_close(struct disk_t* pdisk) {
     if (pdisk == NULL) {
         errno = EFAULT;
         return -1;
     }
 
+    if (pdisk->compressed != NULL) compressed_disk_close(pdisk->compressed);
     fclose(pdisk->fd);
+    free(pdisk->file_name);
     free(pdisk);
 
     return 0;
 }
 
 struct volume_t* fat_open(struct disk_t* pdisk, uint32_t first_sector) {
-    unsigned char buf[BYTES_PER_SECTOR];
-    if (disk_read(pdisk, first_sector, buf, 1) == -1) {
-        // disk_read sets errno for invalid pdisk pointer and buffer
+    struct boot_record_t* boot_record = malloc(sizeof(struct boot_record_t));
+    if (boot_record == NULL) {
+        goto memory_error;
+    }
+
+    if (pdisk == NULL) {
+        free(boot_record);
+        errno = EFAULT;
         return NULL;
     }
 
-    struct boot_record_t* boot_record = (struct boot_record_t*)buf;
+    // The volume's sector size isn't known yet, so read just the boot record
+    struct iovec boot_iov = {.iov_base = boot_record, .iov_len = sizeof(struct boot_record_t)};
+    if (disk_preadv(pdisk, (uint64_t)first_sector * DISK_SECTOR_SIZE, &boot_iov, 1) == -1) {
+        free(boot_record);
+        return NULL;
+    }
 
     // Extended boot record signature
-    if (boot_record->ebpb_signature != 0x28 && boot_record->ebpb_signature != 0x29)
+    if (boot_record->ebpb_signature != 0x28 && boot_record->ebpb_signature != 0x29) {
+        free(boot_record);
         goto validation_error;
+    }
 
     // Boot sector signature
     if (boot_record->boot_signature[0] != 0x55 ||
-        boot_record->boot_signature[1] != 0xAA)
+        boot_record->boot_signature[1] != 0xAA) {
+        free(boot_record);
         goto validation_error;
+    }
+
+    // Both must be powers of two, sectors between 512 and 4096 bytes
+    uint16_t bytes_per_sector = boot_record->bytes_per_sector;
+    uint8_t sectors_per_cluster = boot_record->sectors_per_cluster;
+    if (bytes_per_sector < MIN_BYTES_PER_SECTOR || bytes_per_sector > MAX_BYTES_PER_SECTOR ||
+        (bytes_per_sector & (bytes_per_sector - 1)) != 0 || sectors_per_cluster == 0 ||
+        (sectors_per_cluster & (sectors_per_cluster - 1)) != 0) {
+        free(boot_record);
+        goto validation_error;
+    }
+
+    // Everything from here on is in volume sectors, the disk is left as is
+    uint8_t sector_shift = __builtin_ctz(bytes_per_sector);
 
     struct volume_t* volume = malloc(sizeof(struct volume_t));
     if (volume == NULL) {
         free(boot_record);
         goto memory_error;
     }
+    volume->disk = pdisk;
+    volume->sector_shift = sector_shift;
 
-    uint16_t fat_size = boot_record->sectors_per_fat * BYTES_PER_SECTOR;
+    uint32_t fat_size = (uint32_t)boot_record->sectors_per_fat << sector_shift;
 
     uint16_t* fat = malloc(fat_size);
     if (fat == NULL) {
@@ -160,7 +264,7 @@ struct volume_t* fat_open(struct disk_t* pdisk, uint32_t first_sector) {
         goto memory_error;
     }
 
-    if (disk_read(pdisk, boot_record->reserved_sectors, fat,
+    if (volume_read(volume, boot_record->reserved_sectors, fat,
                   boot_record->sectors_per_fat) == -1) {
         free(boot_record);
         free(volume);
@@ -169,8 +273,11 @@ struct volume_t* fat_open(struct disk_t* pdisk, uint32_t first_sector) {
     }
 
     uint8_t dir_entry_size = sizeof(struct root_entry_t);
-    uint32_t root_dir_size = boot_record->root_entries * dir_entry_size;
-    uint16_t root_dir_sectors = root_dir_size / BYTES_PER_SECTOR;
+    // Whole sectors are read, the tail of the last one holds no entries
+    uint32_t root_dir_sectors =
+        ((uint32_t)boot_record->root_entries * dir_entry_size + bytes_per_sector - 1) >>
+        sector_shift;
+    uint32_t root_dir_size = root_dir_sectors << sector_shift;
     uint32_t root_dir_start = boot_record->reserved_sectors +
                               boot_record->fat_number * boot_record->sectors_per_fat;
 
@@ -182,7 +289,7 @@ struct volume_t* fat_open(struct disk_t* pdisk, uint32_t first_sector) {
         goto memory_error;
     }
 
-    if (disk_read(pdisk, root_dir_start, root_dir, root_dir_sectors) == -1) {
+    if (volume_read(volume, root_dir_start, root_dir, root_dir_sectors) == -1) {
         free(boot_record);
         free(volume);
         free(fat);
@@ -206,11 +313,11 @@ struct volume_t* fat_open(struct disk_t* pdisk, uint32_t first_sector) {
             realloc(volume->root_entries,
                     volume->root_entries_n * sizeof(struct root_entry_t*));
         if (newptr == NULL) {
+            free(volume->root_entries);
             free(boot_record);
             free(volume);
             free(fat);
             free(root_dir);
-            if (volume->root_entries != NULL) free(volume->root_entries);
             goto memory_error;
         }
 
@@ -223,11 +330,34 @@ struct volume_t* fat_open(struct disk_t* pdisk, uint32_t first_sector) {
     volume->fat = fat;
     volume->root_dir = root_dir;
     volume->first_data_sector = root_dir_start;
-    volume->sectors_per_cluster = boot_record->sectors_per_cluster;
-    volume->bytes_per_cluster = boot_record->sectors_per_cluster * BYTES_PER_SECTOR;
+    volume->sectors_per_cluster = sectors_per_cluster;
+    volume->bytes_per_sector = bytes_per_sector;
+    volume->sector_shift = sector_shift;
+    volume->cluster_sectors_shift = __builtin_ctz(sectors_per_cluster);
+    volume->cluster_shift = sector_shift + volume->cluster_sectors_shift;
+    volume->bytes_per_cluster = (uint32_t)1 << volume->cluster_shift;
     volume->data_start = boot_record->reserved_sectors + boot_record->hidden_sectors +
                          (boot_record->fat_number * boot_record->sectors_per_fat) +
-                         (boot_record->root_entries / 16);
+                         root_dir_sectors;
+
+    // Highest valid cluster number + 1, limited by what the FAT can address
+    uint32_t total_sectors = boot_record->total_sectors != 0 ? boot_record->total_sectors
+                                                             : boot_record->large_sector_count;
+    uint32_t data_offset = volume->data_start - boot_record->hidden_sectors;
+    uint32_t data_clusters = total_sectors > data_offset
+                                 ? (total_sectors - data_offset) >> volume->cluster_sectors_shift
+                                 : 0;
+    volume->clusters_n = data_clusters + 2;
+    if (volume->clusters_n > fat_size / 2) volume->clusters_n = fat_size / 2;
+
+    // A stale or missing sidecar just means reading directories from disk
+    volume->sidecar = NULL;
+    if (pdisk->file_name != NULL) {
+        size_t sidecar_name_len = strlen(pdisk->file_name) + sizeof(SIDECAR_SUFFIX);
+        char sidecar_name[sidecar_name_len];
+        snprintf(sidecar_name, sidecar_name_len, "%s%s", pdisk->file_name, SIDECAR_SUFFIX);
+        volume->sidecar = sidecar_open(volume, sidecar_name);
+    }
 
     return volume;
 
@@ -240,13 +370,38 @@ validation_error:
     return NULL;
 }
 
+// First sector of a data cluster, cluster numbers start at 2
+uint32_t cluster_sector(const struct volume_t* pvolume, uint16_t cluster) {
+    return pvolume->data_start + ((uint32_t)(cluster - 2) << pvolume->cluster_sectors_shift);
+}
+
+// Same as `disk_read`, but in sectors of the volume's size
+int volume_read(struct volume_t* pvolume, uint32_t first_sector, void* buffer,
+                uint32_t sectors_to_read) {
+    if (pvolume == NULL || buffer == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    struct iovec iov = {.iov_base = buffer,
+                        .iov_len = (size_t)sectors_to_read << pvolume->sector_shift};
+    if (disk_preadv(pvolume->disk, (uint64_t)first_sector << pvolume->sector_shift, &iov, 1) ==
+        -1) {
+        return -1;
+    }
+
+    return sectors_to_read;
+}
+
 int fat_close(struct volume_t* pvolume) {
     if (pvolume == NULL) {
         errno = EFAULT;
         return -1;
     }
 
+    if (pvolume->sidecar != NULL) sidecar_close(pvolume->sidecar);
     free(pvolume->root_entries);
+    free(pvolume->boot_record);
     free(pvolume->fat);
     free(pvolume->root_dir);
     free(pvolume);
@@ -262,6 +417,16 @@ struct root_entry_t* find_file(struct volume_t* pvolume, const char* path) {
     uint8_t dir_entry_size = sizeof(struct root_entry_t);
     struct root_entry_t* current_entry = NULL;
 
+    if (pvolume->sidecar != NULL) {
+        int32_t node = sidecar_lookup(pvolume->sidecar, path);
+        if (node <= 0) return NULL;
+
+        current_entry = malloc(dir_entry_size);
+        if (current_entry != NULL) sidecar_entry(pvolume->sidecar, node, current_entry);
+
+        return current_entry;
+    }
+
     char* part;
     while ((part = strsep((char**)&path, "\\")) != NULL) {
         if (strlen(part) == 0) continue;
@@ -299,15 +464,21 @@ struct root_entry_t* find_file(struct volume_t* pvolume, const char* path) {
         // Other entries
         else if ((current_entry->attributes >> 4) & 1) {
             uint16_t current_cluster = current_entry->first_cluster;
+            uint32_t clusters_left = pvolume->clusters_n;
 
             uint8_t* buf = malloc(pvolume->bytes_per_cluster);
             struct root_entry_t* entry = malloc(dir_entry_size);
 
             while (!new_entry) {
-                uint32_t sector = pvolume->data_start + ((current_cluster - 2) *
-                                                         pvolume->sectors_per_cluster);
+                // Stop at the end of the chain, or if a corrupt FAT loops it
+                if (current_cluster < 2 || current_cluster >= pvolume->clusters_n ||
+                    clusters_left-- == 0) {
+                    break;
+                }
+
+                uint32_t sector = cluster_sector(pvolume, current_cluster);
 
-                if (disk_read(pvolume->disk, sector, buf,
+                if (volume_read(pvolume, sector, buf,
                               pvolume->sectors_per_cluster) == -1) {
                     free(buf);
                     return NULL;
@@ -319,6 +490,7 @@ struct root_entry_t* find_file(struct volume_t* pvolume, const char* path) {
                     uint32_t offset = i * dir_entry_size;
                     i++;
                     if (entry == NULL) break;
+                    if (offset + dir_entry_size > pvolume->bytes_per_cluster) break;
                     memcpy(entry, buf + offset, dir_entry_size);
 
                     if (entry->name[0] == 0) break;
@@ -335,7 +507,9 @@ struct root_entry_t* find_file(struct volume_t* pvolume, const char* path) {
 
                     free(name);
 
-                    if (entry->first_cluster != 0) {
+                    // Only ".." can point back to the root dir, empty files
+                    // also have first_cluster == 0
+                    if (entry->first_cluster != 0 || !((entry->attributes >> 4) & 1)) {
                         memcpy(current_entry, entry, dir_entry_size);
                     } else {
                         found_root = true;
@@ -370,34 +544,11 @@ struct root_entry_t* find_file(struct volume_t* pvolume, const char* path) {
     return current_entry;
 }
 
-struct file_t* file_open(struct volume_t* pvolume, const char* file_name) {
-    if (pvolume == NULL || file_name == NULL) {
-        errno = EFAULT;
-        return NULL;
-    }
-
-    char* search_name = make_all_caps(file_name, strlen(file_name));
-
-    // Find an entry with the correct path
-    struct root_entry_t* entry = find_file(pvolume, search_name);
-    if (entry == NULL) {
-        free(search_name);
-        errno = ENOENT;
-        return NULL;
-    }
-
-    free(search_name);
-
-    // Don't try opening directories or volumes
-    if ((entry->attributes >> 3) & 1 || (entry->attributes >> 4) & 1) {
-        free(entry);
-        errno = EISDIR;
-        return NULL;
-    }
-
+// Builds a file handle with its cluster chain from an already resolved entry.
+// The entry is left for the caller to free.
+struct file_t* file_open_entry(struct volume_t* pvolume, struct root_entry_t* entry) {
     struct file_t* fd = malloc(sizeof(struct file_t));
     if (fd == NULL) {
-        free(entry);
         goto memory_error;
     }
 
@@ -407,31 +558,38 @@ struct file_t* file_open(struct volume_t* pvolume, const char* file_name) {
     fd->size = entry->size;
     fd->attributes = entry->attributes;
     fd->read_head = 0;
+    fd->extents = NULL;
+    fd->extents_n = 0;
     fd->volume = pvolume;
 
     struct cluster_t* current_cluster = malloc(sizeof(struct cluster_t));
     if (current_cluster == NULL) {
-        free(entry);
         free(fd);
         goto memory_error;
     }
 
-    uint16_t sectors_per_cluster = pvolume->sectors_per_cluster;
-
     current_cluster->number = entry->first_cluster;
-    current_cluster->sector =
-        pvolume->data_start + ((entry->first_cluster - 2) * sectors_per_cluster);
+    current_cluster->sector = cluster_sector(pvolume, entry->first_cluster);
     current_cluster->next = NULL;
 
     fd->clusters = current_cluster;
 
-    while (true) {
+    uint32_t clusters_left = pvolume->clusters_n;
+
+    while (current_cluster->number < pvolume->clusters_n) {
         uint16_t new_cluster_number = pvolume->fat[current_cluster->number];
 
-        if (new_cluster_number >= 0xFFF8) {
+        if (new_cluster_number < 2 || new_cluster_number >= pvolume->clusters_n) {
             break;
         }
 
+        // A chain longer than the volume has clusters must contain a loop
+        if (--clusters_left == 0) {
+            file_close(fd);
+            errno = EIO;
+            return NULL;
+        }
+
         struct cluster_t* new_cluster = malloc(sizeof(struct cluster_t));
         if (new_cluster == NULL) {
             struct cluster_t* tmp;
@@ -440,22 +598,18 @@ struct file_t* file_open(struct volume_t* pvolume, const char* file_name) {
                 fd->clusters = fd->clusters->next;
                 free(tmp);
             }
-            free(entry);
             free(fd);
             goto memory_error;
         }
 
         new_cluster->number = new_cluster_number;
-        new_cluster->sector =
-            pvolume->data_start + ((new_cluster_number - 2) * sectors_per_cluster);
+        new_cluster->sector = cluster_sector(pvolume, new_cluster_number);
         new_cluster->next = NULL;
 
         current_cluster->next = new_cluster;
         current_cluster = new_cluster;
     }
 
-    free(entry);
-
     return fd;
 
 memory_error:
@@ -463,6 +617,55 @@ memory_error:
     return NULL;
 }
 
+struct file_t* file_open(struct volume_t* pvolume, const char* file_name) {
+    if (pvolume == NULL || file_name == NULL) {
+        errno = EFAULT;
+        return NULL;
+    }
+
+    char* search_name = make_all_caps(file_name, strlen(file_name));
+
+    // Find an entry with the correct path. The sidecar also knows the
+    // extents, so keep the node around.
+    struct root_entry_t* entry = NULL;
+    int32_t node = -1;
+    if (pvolume->sidecar != NULL) {
+        node = search_name != NULL ? sidecar_lookup(pvolume->sidecar, search_name) : -1;
+        if (node > 0) {
+            entry = malloc(sizeof(struct root_entry_t));
+            if (entry != NULL) sidecar_entry(pvolume->sidecar, node, entry);
+        }
+    } else {
+        entry = find_file(pvolume, search_name);
+    }
+
+    if (entry == NULL) {
+        free(search_name);
+        errno = ENOENT;
+        return NULL;
+    }
+
+    free(search_name);
+
+    // Don't try opening directories or volumes
+    if ((entry->attributes >> 3) & 1 || (entry->attributes >> 4) & 1) {
+        free(entry);
+        errno = EISDIR;
+        return NULL;
+    }
+
+    struct file_t* fd = file_open_entry(pvolume, entry);
+    free(entry);
+
+    if (fd != NULL && node > 0) {
+        struct sidecar_node_t* n = &pvolume->sidecar->nodes[node];
+        fd->extents = pvolume->sidecar->extents + n->first_extent;
+        fd->extents_n = n->extents_n;
+    }
+
+    return fd;
+}
+
 int file_close(struct file_t* stream) {
     if (stream == NULL) {
         errno = EFAULT;
@@ -494,45 +697,69 @@ size_t file_read(void* ptr, size_t size, size_t nmemb, struct file_t* stream) {
 
     uint16_t sectors_per_cluster = stream->volume->sectors_per_cluster;
     uint32_t bytes_per_cluster = stream->volume->bytes_per_cluster;
-    struct cluster_t* current_cluster = stream->clusters;
+    uint8_t cluster_shift = stream->volume->cluster_shift;
     uint8_t* out = (uint8_t*)ptr;
-
-    uint8_t* buf = malloc(bytes_per_cluster);
-    if (buf == NULL) {
-        errno = ENOMEM;
-        return -1;
-    }
+    uint8_t* buf = NULL;
 
     uint32_t bytes_left = size * nmemb;
-    uint32_t pos = 0;
+    if (bytes_left > stream->size - stream->read_head) {
+        bytes_left = stream->size - stream->read_head;
+    }
     uint32_t bytes_read = 0;
 
-    while (current_cluster != NULL && bytes_left > 0) {
-        // Read a full sector to `buf`
-        if (disk_read(stream->volume->disk, current_cluster->sector, buf,
-                      sectors_per_cluster) == -1) {
-            free(buf);
-            return -1;
-        }
-
+    // Clusters before the read head are skipped without reading them
+    struct cluster_t* current_cluster = stream->clusters;
+    for (uint32_t i = stream->read_head >> cluster_shift;
+         i > 0 && current_cluster != NULL; i--) {
         current_cluster = current_cluster->next;
+    }
 
-        uint32_t pos_in_cluster = 0;
+    while (current_cluster != NULL && bytes_left > 0) {
+        uint32_t pos_in_cluster = stream->read_head & (bytes_per_cluster - 1);
+
+        if (pos_in_cluster == 0 && bytes_left >= bytes_per_cluster) {
+            // Runs of whole, contiguous clusters go straight to the caller
+            uint32_t clusters = 1;
+            struct cluster_t* last = current_cluster;
+            while (last->next != NULL && last->next->sector == last->sector + sectors_per_cluster &&
+                   bytes_left >= (uint64_t)(clusters + 1) << cluster_shift) {
+                last = last->next;
+                clusters++;
+            }
 
-        while (bytes_left > 0 && pos_in_cluster < bytes_per_cluster &&
-               pos < stream->size) {
-            if (pos >= stream->read_head) {
-                out[bytes_read] = buf[pos_in_cluster];
+            if (volume_read(stream->volume, current_cluster->sector, out + bytes_read,
+                          clusters << stream->volume->cluster_sectors_shift) == -1) {
+                free(buf);
+                return -1;
+            }
 
-                stream->read_head++;
+            uint32_t n = clusters << cluster_shift;
+            stream->read_head += n;
+            bytes_read += n;
+            bytes_left -= n;
+            current_cluster = last->next;
+            continue;
+        }
 
-                bytes_read++;
-                bytes_left--;
-            }
+        if (buf == NULL && (buf = malloc(bytes_per_cluster)) == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
 
-            pos_in_cluster++;
-            pos++;
+        if (volume_read(stream->volume, current_cluster->sector, buf,
+                      sectors_per_cluster) == -1) {
+            free(buf);
+            return -1;
         }
+
+        uint32_t n = bytes_per_cluster - pos_in_cluster;
+        if (n > bytes_left) n = bytes_left;
+
+        memcpy(out + bytes_read, buf + pos_in_cluster, n);
+        stream->read_head += n;
+        bytes_read += n;
+        bytes_left -= n;
+        current_cluster = current_cluster->next;
     }
 
     free(buf);
@@ -553,8 +780,8 @@ int32_t file_seek(struct file_t* stream, int32_t offset, int whence) {
 
     switch (whence) {
         case SEEK_SET:
-            // Offset can't be larger than stream->size
-            if (offset > stream->size) goto bounds_error;
+            // Offset must lie within [0, stream->size]
+            if (offset < 0 || (uint32_t)offset > stream->size) goto bounds_error;
             stream->read_head = offset;
             break;
         case SEEK_END:
@@ -576,6 +803,586 @@ bounds_error:
     return -1;
 }
 
+// Collapses the cluster chain into runs of contiguous sectors, trimmed to the
+// clusters actually covered by the file size. `*extents` must be freed.
+int file_extents(struct file_t* stream, struct extent_t** extents, size_t* extents_n) {
+    if (stream == NULL || extents == NULL || extents_n == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    uint32_t bytes_per_cluster = stream->volume->bytes_per_cluster;
+    uint32_t clusters_left =
+        ((uint64_t)stream->size + bytes_per_cluster - 1) >> stream->volume->cluster_shift;
+
+    *extents = NULL;
+    *extents_n = 0;
+
+    if (stream->extents != NULL) {
+        *extents = malloc((stream->extents_n > 0 ? stream->extents_n : 1) *
+                          sizeof(struct extent_t));
+        if (*extents == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        memcpy(*extents, stream->extents, stream->extents_n * sizeof(struct extent_t));
+        *extents_n = stream->extents_n;
+        return 0;
+    }
+
+    size_t capacity = 0;
+    struct cluster_t* current_cluster = stream->clusters;
+
+    while (current_cluster != NULL && clusters_left > 0) {
+        struct extent_t* last = *extents_n > 0 ? &(*extents)[*extents_n - 1] : NULL;
+
+        if (last != NULL && last->sector + last->sectors == current_cluster->sector) {
+            last->sectors += stream->volume->sectors_per_cluster;
+        } else {
+            if (*extents_n == capacity) {
+                capacity = capacity == 0 ? 4 : capacity * 2;
+                struct extent_t* newptr = realloc(*extents, capacity * sizeof(struct extent_t));
+                if (newptr == NULL) {
+                    free(*extents);
+                    *extents = NULL;
+                    errno = ENOMEM;
+                    return -1;
+                }
+                *extents = newptr;
+            }
+
+            (*extents)[*extents_n].sector = current_cluster->sector;
+            (*extents)[*extents_n].sectors = stream->volume->sectors_per_cluster;
+            (*extents_n)++;
+        }
+
+        current_cluster = current_cluster->next;
+        clusters_left--;
+    }
+
+    return 0;
+}
+
+// Piece of a `file_readv` range that lies within a single extent
+struct readv_piece_t {
+    uint64_t disk_offset;
+    uint8_t* buf;
+    size_t len;
+};
+
+int compare_readv_pieces(const void* a, const void* b) {
+    const struct readv_piece_t* x = a;
+    const struct readv_piece_t* y = b;
+
+    if (x->disk_offset != y->disk_offset) return x->disk_offset < y->disk_offset ? -1 : 1;
+
+    return 0;
+}
+
+// Reads several discontiguous ranges of a file. Ranges are mapped onto the
+// cluster chain, sorted by their position on disk and ranges that touch the
+// same or adjacent sectors are read by a single preadv, with the bytes in
+// between going to a scratch buffer. Ranges are clipped at the end of the file
+// and the file's read head is not moved. Returns the number of bytes read, or
+// fails with EIO if the cluster chain ends before a range does.
+ssize_t file_readv(struct file_t* stream, const struct iovec* iov, const uint32_t* offsets,
+                   int iovcnt) {
+    if (stream == NULL || iov == NULL || offsets == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if (iovcnt < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct extent_t* extents = NULL;
+    size_t extents_n = 0;
+    if (file_extents(stream, &extents, &extents_n) == -1) {
+        return -1;
+    }
+
+    uint8_t sector_shift = stream->volume->sector_shift;
+
+    // Every range can be split at most once per extent boundary
+    size_t pieces_capacity = 0;
+    size_t pieces_n = 0;
+    struct readv_piece_t* pieces = NULL;
+    ssize_t total = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+        if (offsets[i] >= stream->size || iov[i].iov_len == 0) continue;
+
+        uint32_t start = offsets[i];
+        uint32_t end = iov[i].iov_len > stream->size - start ? stream->size
+                                                             : start + iov[i].iov_len;
+        total += end - start;
+
+        uint32_t extent_start = 0;
+        for (size_t j = 0; j < extents_n && start < end; j++) {
+            uint32_t extent_len = extents[j].sectors << sector_shift;
+            uint32_t extent_end = extent_start + extent_len;
+
+            if (start < extent_end) {
+                uint32_t piece_end = end < extent_end ? end : extent_end;
+
+                if (pieces_n == pieces_capacity) {
+                    pieces_capacity = pieces_capacity == 0 ? 16 : pieces_capacity * 2;
+                    struct readv_piece_t* newptr =
+                        realloc(pieces, pieces_capacity * sizeof(struct readv_piece_t));
+                    if (newptr == NULL) {
+                        free(pieces);
+                        free(extents);
+                        errno = ENOMEM;
+                        return -1;
+                    }
+                    pieces = newptr;
+                }
+
+                pieces[pieces_n].disk_offset =
+                    ((uint64_t)extents[j].sector << sector_shift) + (start - extent_start);
+                pieces[pieces_n].buf = (uint8_t*)iov[i].iov_base + (start - offsets[i]);
+                pieces[pieces_n].len = piece_end - start;
+                pieces_n++;
+
+                start = piece_end;
+            }
+
+            extent_start = extent_end;
+        }
+
+        // Nothing on disk backs the rest of the range
+        if (start < end) {
+            free(pieces);
+            free(extents);
+            errno = EIO;
+            return -1;
+        }
+    }
+
+    free(extents);
+
+    if (pieces_n > 0) {
+        qsort(pieces, pieces_n, sizeof(struct readv_piece_t), compare_readv_pieces);
+    }
+
+    // Gaps inside a run are always shorter than two sectors
+    uint8_t scratch[2 * MAX_BYTES_PER_SECTOR];
+    struct iovec run[IOV_MAX];
+    int run_n = 0;
+    uint64_t run_start = 0;
+    uint64_t run_end = 0;
+    int result = 0;
+
+    for (size_t i = 0; i <= pieces_n && result == 0; i++) {
+        struct readv_piece_t* piece = i < pieces_n ? &pieces[i] : NULL;
+
+        if (piece != NULL && run_n > 0 && piece->disk_offset < run_end) {
+            // Overlaps bytes already going to another buffer, read it on its own
+            result = disk_preadv(stream->volume->disk, piece->disk_offset,
+                                 &(struct iovec){piece->buf, piece->len}, 1);
+            continue;
+        }
+
+        bool adjacent = piece != NULL && run_n > 0 && run_n <= IOV_MAX - 2 &&
+                        piece->disk_offset >> sector_shift <=
+                            ((run_end - 1) >> sector_shift) + 1;
+
+        if (!adjacent && run_n > 0) {
+            result = disk_preadv(stream->volume->disk, run_start, run, run_n);
+            run_n = 0;
+            if (result != 0) break;
+        }
+
+        if (piece == NULL) break;
+
+        if (run_n == 0) {
+            run_start = piece->disk_offset;
+        } else if (piece->disk_offset > run_end) {
+            run[run_n].iov_base = scratch;
+            run[run_n].iov_len = piece->disk_offset - run_end;
+            run_n++;
+        }
+
+        run[run_n].iov_base = piece->buf;
+        run[run_n].iov_len = piece->len;
+        run_n++;
+        run_end = piece->disk_offset + piece->len;
+    }
+
+    free(pieces);
+
+    return result == 0 ? total : -1;
+}
+
+// Converts a single path part to the padded 8.3 form used in directory entries
+// so it can be compared with memcmp. Returns false if the part can't be a
+// valid short name, in which case it can't match any entry.
+bool make_short_name(const char* part, uint8_t* out) {
+    memset(out, ' ', 11);
+
+    // "." and ".." are stored as names without an extension
+    if (strcmp(part, ".") == 0 || strcmp(part, "..") == 0) {
+        memcpy(out, part, strlen(part));
+        return true;
+    }
+
+    const char* dot = strchr(part, '.');
+    size_t name_len = dot == NULL ? strlen(part) : (size_t)(dot - part);
+    size_t ext_len = dot == NULL ? 0 : strlen(dot + 1);
+
+    if (name_len == 0 || name_len > 8 || ext_len > 3) return false;
+    if (dot != NULL && strchr(dot + 1, '.') != NULL) return false;
+
+    memcpy(out, part, name_len);
+    if (dot != NULL) memcpy(out + 8, dot + 1, ext_len);
+
+    return true;
+}
+
+// Reads every cluster of a directory into one buffer and collects pointers to
+// its live entries. Both `*entries` and the returned buffer must be freed.
+uint8_t* read_dir_entries(struct volume_t* pvolume, uint16_t first_cluster,
+                          struct root_entry_t*** entries, size_t* entries_n) {
+    uint8_t dir_entry_size = sizeof(struct root_entry_t);
+    uint8_t* buf = NULL;
+    size_t clusters_n = 0;
+    uint16_t current_cluster = first_cluster;
+
+    while (current_cluster >= 2 && current_cluster < pvolume->clusters_n) {
+        // A chain longer than the volume has clusters must contain a loop
+        if (clusters_n == pvolume->clusters_n) {
+            free(buf);
+            errno = EIO;
+            return NULL;
+        }
+
+        uint8_t* newbuf = realloc(buf, (clusters_n + 1) << pvolume->cluster_shift);
+        if (newbuf == NULL) {
+            free(buf);
+            errno = ENOMEM;
+            return NULL;
+        }
+        buf = newbuf;
+
+        uint32_t sector = cluster_sector(pvolume, current_cluster);
+        if (volume_read(pvolume, sector, buf + (clusters_n << pvolume->cluster_shift),
+                      pvolume->sectors_per_cluster) == -1) {
+            free(buf);
+            return NULL;
+        }
+
+        clusters_n++;
+        current_cluster = pvolume->fat[current_cluster];
+    }
+
+    size_t max_entries = (clusters_n << pvolume->cluster_shift) / dir_entry_size;
+    *entries = malloc((max_entries > 0 ? max_entries : 1) * sizeof(struct root_entry_t*));
+    if (*entries == NULL) {
+        free(buf);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    *entries_n = 0;
+    for (size_t i = 0; i < max_entries; i++) {
+        struct root_entry_t* entry = (struct root_entry_t*)(buf + i * dir_entry_size);
+
+        if (entry->name[0] == 0) break;
+        if (entry->name[0] == 0xE5 || entry->attributes == 0x0F) continue;
+
+        (*entries)[(*entries_n)++] = entry;
+    }
+
+    // Keep a valid pointer for empty directories so callers can free it
+    if (buf == NULL) buf = malloc(1);
+
+    return buf;
+}
+
+struct batch_item_t {
+    size_t index;
+    uint8_t (*parts)[11];
+    size_t parts_n;
+    struct root_entry_t entry;
+    bool is_root;
+    int error;
+};
+
+int compare_batch_items(const void* a, const void* b) {
+    const struct batch_item_t* x = *(const struct batch_item_t* const*)a;
+    const struct batch_item_t* y = *(const struct batch_item_t* const*)b;
+
+    size_t n = x->parts_n < y->parts_n ? x->parts_n : y->parts_n;
+    for (size_t i = 0; i < n; i++) {
+        int cmp = memcmp(x->parts[i], y->parts[i], 11);
+        if (cmp != 0) return cmp;
+    }
+
+    if (x->parts_n != y->parts_n) return x->parts_n < y->parts_n ? -1 : 1;
+
+    return 0;
+}
+
+// Resolves a sorted group of items that all continue below the same directory.
+// Each directory is read once no matter how many items pass through it.
+void batch_resolve(struct volume_t* pvolume, struct root_entry_t** entries,
+                   size_t entries_n, struct batch_item_t** items, size_t items_n,
+                   size_t depth) {
+    size_t group_start = 0;
+
+    while (group_start < items_n) {
+        uint8_t* part = items[group_start]->parts[depth];
+
+        size_t group_end = group_start + 1;
+        while (group_end < items_n && memcmp(items[group_end]->parts[depth], part, 11) == 0) {
+            group_end++;
+        }
+
+        struct root_entry_t* found = NULL;
+        for (size_t i = 0; i < entries_n; i++) {
+            if (memcmp(entries[i]->name, part, 11) == 0) {
+                found = entries[i];
+                break;
+            }
+        }
+
+        // Items ending here come first thanks to the sort order
+        size_t deeper_start = group_start;
+        while (deeper_start < group_end && items[deeper_start]->parts_n == depth + 1) {
+            struct batch_item_t* item = items[deeper_start];
+            if (found == NULL) {
+                item->error = ENOENT;
+            } else if (((found->attributes >> 4) & 1) && found->first_cluster == 0) {
+                // ".." pointing back to the root directory
+                item->is_root = true;
+            } else {
+                item->entry = *found;
+            }
+            deeper_start++;
+        }
+
+        if (deeper_start < group_end) {
+            bool is_dir = found != NULL && ((found->attributes >> 4) & 1) &&
+                          !((found->attributes >> 3) & 1);
+
+            struct root_entry_t** sub_entries = NULL;
+            size_t sub_entries_n = 0;
+            uint8_t* sub_buf = NULL;
+            int error = ENOENT;
+
+            if (is_dir && found->first_cluster == 0) {
+                sub_entries = pvolume->root_entries;
+                sub_entries_n = pvolume->root_entries_n;
+                error = 0;
+            } else if (is_dir) {
+                sub_buf = read_dir_entries(pvolume, found->first_cluster, &sub_entries,
+                                           &sub_entries_n);
+                error = sub_buf == NULL ? errno : 0;
+            }
+
+            if (error == 0) {
+                batch_resolve(pvolume, sub_entries, sub_entries_n, items + deeper_start,
+                              group_end - deeper_start, depth + 1);
+            } else {
+                for (size_t i = deeper_start; i < group_end; i++) {
+                    items[i]->error = error;
+                }
+            }
+
+            if (sub_buf != NULL) {
+                free(sub_entries);
+                free(sub_buf);
+            }
+        }
+
+        group_start = group_end;
+    }
+}
+
+// Splits, sorts and resolves all paths. Returns an array of `n` items indexed in
+// the caller's order or NULL on allocation failure.
+struct batch_item_t* batch_lookup(struct volume_t* pvolume, const char** paths, size_t n) {
+    struct batch_item_t* items = calloc(n > 0 ? n : 1, sizeof(struct batch_item_t));
+    struct batch_item_t** sorted = calloc(n > 0 ? n : 1, sizeof(struct batch_item_t*));
+    if (items == NULL || sorted == NULL) {
+        free(items);
+        free(sorted);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    size_t sorted_n = 0;
+    for (size_t i = 0; i < n; i++) {
+        struct batch_item_t* item = &items[i];
+        item->index = i;
+
+        if (paths[i] == NULL) {
+            item->error = EFAULT;
+            continue;
+        }
+
+        char* search_name = make_all_caps(paths[i], strlen(paths[i]));
+        if (search_name == NULL) {
+            item->error = ENOMEM;
+            continue;
+        }
+
+        // The sidecar answers each path directly, there are no scans to share
+        if (pvolume->sidecar != NULL) {
+            int32_t node = sidecar_lookup(pvolume->sidecar, search_name);
+            free(search_name);
+
+            if (node == -1) {
+                item->error = errno;
+            } else if (node == 0) {
+                item->is_root = true;
+            } else {
+                sidecar_entry(pvolume->sidecar, node, &item->entry);
+            }
+            continue;
+        }
+
+        // A path can't have more parts than half its length rounded up
+        item->parts = malloc((strlen(search_name) / 2 + 1) * 11);
+        if (item->parts == NULL) {
+            free(search_name);
+            item->error = ENOMEM;
+            continue;
+        }
+
+        char* rest = search_name;
+        char* part;
+        while ((part = strsep(&rest, "\\")) != NULL) {
+            if (strlen(part) == 0) continue;
+
+            if (!make_short_name(part, item->parts[item->parts_n])) {
+                item->error = ENOENT;
+                break;
+            }
+            item->parts_n++;
+        }
+
+        free(search_name);
+
+        if (item->error != 0) continue;
+
+        if (item->parts_n == 0) {
+            item->is_root = true;
+            continue;
+        }
+
+        sorted[sorted_n++] = item;
+    }
+
+    qsort(sorted, sorted_n, sizeof(struct batch_item_t*), compare_batch_items);
+    batch_resolve(pvolume, pvolume->root_entries, pvolume->root_entries_n, sorted,
+                  sorted_n, 0);
+
+    free(sorted);
+
+    return items;
+}
+
+void batch_free(struct batch_item_t* items, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        free(items[i].parts);
+    }
+    free(items);
+}
+
+int file_stat_batch(struct volume_t* pvolume, const char** paths, size_t n,
+                    struct file_stat_t* stats) {
+    if (pvolume == NULL || paths == NULL || stats == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    struct batch_item_t* items = batch_lookup(pvolume, paths, n);
+    if (items == NULL) {
+        return -1;
+    }
+
+    int found = 0;
+    for (size_t i = 0; i < n; i++) {
+        struct batch_item_t* item = &items[i];
+        struct file_stat_t* stat = &stats[i];
+
+        memset(stat, 0, sizeof(struct file_stat_t));
+        stat->error = item->error;
+        if (item->error != 0) continue;
+
+        if (item->is_root) {
+            strcpy(stat->name, "\\");
+            stat->attributes = ATTR_DIRECTORY;
+        } else {
+            uint8_t* name = clean_file_name(item->entry.name, item->entry.ext);
+            if (name == NULL) {
+                stat->error = ENOMEM;
+                continue;
+            }
+            memcpy(stat->name, name, strlen((const char*)name) + 1);
+            free(name);
+
+            stat->attributes = item->entry.attributes;
+            stat->size = item->entry.size;
+            stat->first_cluster = item->entry.first_cluster;
+        }
+
+        found++;
+    }
+
+    batch_free(items, n);
+
+    return found;
+}
+
+// Opens every path with a single walk of the directories they share. Paths
+// that can't be opened get a NULL handle and, if `errors` isn't NULL, the
+// errno value for that path (ENOENT, EISDIR, ...) in `errors[i]`. Returns the
+// number of files opened.
+int file_open_batch(struct volume_t* pvolume, const char** paths, size_t n,
+                    struct file_t** files, int* errors) {
+    if (pvolume == NULL || paths == NULL || files == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    struct batch_item_t* items = batch_lookup(pvolume, paths, n);
+    if (items == NULL) {
+        return -1;
+    }
+
+    int opened = 0;
+    for (size_t i = 0; i < n; i++) {
+        struct batch_item_t* item = &items[i];
+        int error = item->error;
+        files[i] = NULL;
+
+        // Don't try opening directories or volumes
+        if (error == 0 && (item->is_root || (item->entry.attributes >> 3) & 1 ||
+                           (item->entry.attributes >> 4) & 1)) {
+            error = EISDIR;
+        }
+
+        if (error == 0) {
+            files[i] = file_open_entry(pvolume, &item->entry);
+            if (files[i] != NULL) {
+                opened++;
+            } else {
+                error = errno;
+            }
+        }
+
+        if (errors != NULL) errors[i] = error;
+    }
+
+    batch_free(items, n);
+
+    return opened;
+}
+
 struct dir_t* dir_open(struct volume_t* pvolume, const char* dir_path) {
     if (pvolume == NULL) {
         errno = EFAULT;
@@ -604,6 +1411,17 @@ struct dir_t* dir_open(struct volume_t* pvolume, const char* dir_path) {
         return dir;
     }
 
+    if (pvolume->sidecar != NULL) {
+        if (sidecar_list(pvolume->sidecar, clean_path, &dir->entries, &dir->entries_n) == -1) {
+            free(dir);
+            free(clean_path);
+            return NULL;
+        }
+
+        free(clean_path);
+        return dir;
+    }
+
     // FIXME: Should probalby write a separate function for directories
     struct root_entry_t* entry = find_file(pvolume, clean_path);
     if (entry == NULL) {
@@ -628,13 +1446,13 @@ struct dir_t* dir_open(struct volume_t* pvolume, const char* dir_path) {
     struct root_entry_t** entries = NULL;
     size_t entries_n = 0;
     uint16_t current_cluster = entry->first_cluster;
-    bool searching = true;
+    uint32_t clusters_left = pvolume->clusters_n;
+    bool searching = current_cluster >= 2 && current_cluster < pvolume->clusters_n;
 
     while (searching) {
-        uint32_t sector = pvolume->data_start +
-                          ((current_cluster - 2) * pvolume->sectors_per_cluster);
+        uint32_t sector = cluster_sector(pvolume, current_cluster);
 
-        if (disk_read(pvolume->disk, sector, buf, pvolume->sectors_per_cluster) == -1) {
+        if (volume_read(pvolume, sector, buf, pvolume->sectors_per_cluster) == -1) {
             free(dir);
             free(buf);
             return NULL;
@@ -679,7 +1497,9 @@ struct dir_t* dir_open(struct volume_t* pvolume, const char* dir_path) {
             entries[entries_n - 1] = e;
         }
 
-        if (pvolume->fat[current_cluster] >= 0xFFF8) {
+        // End of the chain, or a corrupt FAT that points outside of it or loops
+        uint16_t next_cluster = pvolume->fat[current_cluster];
+        if (next_cluster < 2 || next_cluster >= pvolume->clusters_n || --clusters_left == 0) {
             searching = false;
         }
 
@@ -691,6 +1511,15 @@ struct dir_t* dir_open(struct volume_t* pvolume, const char* dir_path) {
     free(entry);
     free(buf);
 
+    // Same limit as a sidecar listing, dir_t counts entries in 16 bits
+    if (entries_n > UINT16_MAX) {
+        for (size_t i = 0; i < entries_n; i++) free(entries[i]);
+        free(entries);
+        free(dir);
+        errno = EOVERFLOW;
+        return NULL;
+    }
+
     dir->entries = entries;
     dir->entries_n = entries_n;
 
@@ -717,22 +1546,60 @@ int dir_read(struct dir_t* pdir, struct dir_entry_t* pentry) {
 
     struct root_entry_t* entry = pdir->entries[pdir->read_head];
 
-    uint8_t* name = clean_file_name(entry->name, entry->ext);
-    memcpy(pentry->name, name, strlen((const char*)name) + 1);
-    free(name);
+    format_short_name(entry->name, entry->ext, pentry->name);
 
     pentry->size = entry->size;
     pentry->is_readonly = ((entry->attributes >> 0) & 1);
     pentry->is_hidden = ((entry->attributes >> 1) & 1);
     pentry->is_system = ((entry->attributes >> 2) & 1);
     pentry->is_archived = ((entry->attributes >> 5) & 1);
-    pentry->is_directory = entry->size == 0;
+    pentry->is_directory = ((entry->attributes >> 4) & 1);
 
     pdir->read_head++;
 
     return 0;
 }
 
+// Fills up to `n` records and returns how many were filled, 0 at the end of
+// the directory. Nothing is allocated, so listing a big directory costs one
+// call per `n` entries.
+int dir_read_batch(struct dir_t* pdir, struct dir_record_t* records, size_t n) {
+    if (pdir == NULL || records == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if (pdir->entries == NULL) {
+        errno = EIO;
+        return -1;
+    }
+
+    size_t left = pdir->entries_n - pdir->read_head;
+    if (n > left) n = left;
+    if (n > INT_MAX) n = INT_MAX;
+
+    struct root_entry_t** entries = pdir->entries + pdir->read_head;
+
+    for (size_t i = 0; i < n; i++) {
+        struct root_entry_t* entry = entries[i];
+        struct dir_record_t* record = &records[i];
+
+        format_short_name(entry->name, entry->ext, record->name);
+        record->attributes = entry->attributes;
+        record->first_cluster = entry->first_cluster;
+        record->size = entry->size;
+        record->creation_time = entry->creation_time;
+        record->creation_date = entry->creation_date;
+        record->access_date = entry->last_access;
+        record->mod_time = entry->mod_time;
+        record->mod_date = entry->mod_date;
+    }
+
+    pdir->read_head += n;
+
+    return (int)n;
+}
+
 int dir_close(struct dir_t* pdir) {
     if (pdir == NULL) {
         errno = EFAULT;
@@ -752,3 +1619,86 @@ int dir_close(struct dir_t* pdir) {
 
     return 0;
 }
+
+int walk_dir(struct volume_t* pvolume, const char* dir_path, struct root_entry_t** entries,
+             size_t entries_n, bool* seen, walk_callback_t callback, void* arg) {
+    size_t dir_path_len = strlen(dir_path);
+
+    for (size_t i = 0; i < entries_n; i++) {
+        struct root_entry_t* entry = entries[i];
+
+        // Skip volume labels and the "." and ".." entries
+        if ((entry->attributes >> 3) & 1) continue;
+        if (entry->name[0] == '.') continue;
+
+        uint8_t* name = clean_file_name(entry->name, entry->ext);
+        if (name == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        char path[dir_path_len + 14];
+        memcpy(path, dir_path, dir_path_len);
+        path[dir_path_len] = '\\';
+        strcpy(path + dir_path_len + 1, (char*)name);
+        free(name);
+
+        int result = callback(path, entry, arg);
+        if (result != 0) return result;
+
+        if (!((entry->attributes >> 4) & 1) || entry->first_cluster == 0) continue;
+
+        // A directory reached twice is a loop in a corrupt tree
+        if (entry->first_cluster < pvolume->clusters_n) {
+            if (seen[entry->first_cluster]) {
+                errno = EIO;
+                return -1;
+            }
+            seen[entry->first_cluster] = true;
+        }
+
+        struct root_entry_t** sub_entries = NULL;
+        size_t sub_entries_n = 0;
+        uint8_t* buf =
+            read_dir_entries(pvolume, entry->first_cluster, &sub_entries, &sub_entries_n);
+        if (buf == NULL) {
+            return -1;
+        }
+
+        result = walk_dir(pvolume, path, sub_entries, sub_entries_n, seen, callback, arg);
+
+        free(sub_entries);
+        free(buf);
+
+        if (result != 0) return result;
+    }
+
+    return 0;
+}
+
+// Visits every file and directory of the volume depth-first. Paths passed to
+// the callback are absolute, e.g. "\DIR\FILE.TXT".
+int volume_walk(struct volume_t* pvolume, walk_callback_t callback, void* arg) {
+    if (pvolume == NULL || callback == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if (pvolume->sidecar != NULL) {
+        return sidecar_walk(pvolume->sidecar, callback, arg);
+    }
+
+    // Directories already walked, indexed by first cluster
+    bool* seen = calloc(pvolume->clusters_n > 0 ? pvolume->clusters_n : 1, sizeof(bool));
+    if (seen == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    int result = walk_dir(pvolume, "", pvolume->root_entries, pvolume->root_entries_n, seen,
+                          callback, arg);
+
+    free(seen);
+
+    return result;
+}
@@ -4,13 +4,23 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/uio.h>
 
-#define BYTES_PER_SECTOR 512
+// Disks are always addressed in 512-byte sectors, whatever a volume on them
+// declares. `volume_read` takes sectors of the volume's own size.
+#define DISK_SECTOR_SIZE 512
+
+// Sector sizes a boot record may declare
+#define MIN_BYTES_PER_SECTOR 512
+#define MAX_BYTES_PER_SECTOR 4096
 
 struct disk_t {
     FILE* fd;
-    uint32_t file_len;
+    uint64_t file_len;
     uint32_t sectors;
+    // Set when the file is a chunk-compressed image
+    struct compressed_disk_t* compressed;
+    char* file_name;
 };
 
 struct volume_t {
@@ -23,14 +33,25 @@ struct volume_t {
     uint32_t first_data_sector;
     uint8_t sectors_per_cluster;
     uint32_t bytes_per_cluster;
+    uint32_t bytes_per_sector;
+    // log2 of bytes_per_sector, sectors_per_cluster and bytes_per_cluster,
+    // all three are powers of two
+    uint8_t sector_shift;
+    uint8_t cluster_sectors_shift;
+    uint8_t cluster_shift;
     uint32_t data_start;
+    // Number of FAT entries that can be part of a chain, cluster numbers
+    // below 2 are reserved
+    uint32_t clusters_n;
+    // Prebuilt index of the directory tree, NULL if there is no valid one
+    struct sidecar_t* sidecar;
 };
 
 struct boot_record_t {
     // BPB
     uint8_t jump_code[3];
     uint8_t identifier[8];
-    uint16_t small_sector_count;
+    uint16_t bytes_per_sector;
     uint8_t sectors_per_cluster;
     uint16_t reserved_sectors;
     uint8_t fat_number;
@@ -73,10 +94,13 @@ struct root_entry_t {
 struct file_t {
     char name[13];
     uint16_t attributes;
-    uint16_t size;
-    uint16_t read_head;
+    uint32_t size;
+    uint32_t read_head;
     // Linked list of clusters
     struct cluster_t* clusters;
+    // Extents from the volume's sidecar, NULL if they have to be computed
+    const struct extent_t* extents;
+    uint32_t extents_n;
     struct volume_t* volume;
 };
 
@@ -86,6 +110,12 @@ struct cluster_t {
     struct cluster_t* next;
 };
 
+// Run of clusters that are contiguous on disk
+struct extent_t {
+    uint32_t sector;
+    uint32_t sectors;
+};
+
 struct dir_t {
     struct root_entry_t** entries;
     uint16_t entries_n;
@@ -103,21 +133,77 @@ struct dir_entry_t {
     bool is_directory;
 };
 
+#define ATTR_READONLY 0x01
+#define ATTR_HIDDEN 0x02
+#define ATTR_SYSTEM 0x04
+#define ATTR_VOLUME 0x08
+#define ATTR_DIRECTORY 0x10
+#define ATTR_ARCHIVE 0x20
+
+// Fixed-size record filled by `dir_read_batch`. Attributes are the raw
+// ATTR_* bits, times and dates are in the FAT on-disk format.
+struct dir_record_t {
+    char name[13];
+    uint8_t attributes;
+    uint16_t first_cluster;
+    uint32_t size;
+    uint16_t creation_time;
+    uint16_t creation_date;
+    uint16_t access_date;
+    uint16_t mod_time;
+    uint16_t mod_date;
+} __attribute__((packed));
+
+// Result of a single lookup in `file_stat_batch`
+struct file_stat_t {
+    char name[13];
+    uint8_t attributes;
+    uint32_t size;
+    uint16_t first_cluster;
+    // 0 on success, otherwise the errno value for this path
+    int error;
+};
+
+// Called by `volume_walk` for every file and directory. Returning non-zero
+// stops the walk.
+typedef int (*walk_callback_t)(const char* path, struct root_entry_t* entry, void* arg);
+
 struct disk_t* disk_open_from_file(const char* volume_file_name);
 int disk_read(struct disk_t* pdisk, int32_t first_sector, void* buffer,
               int32_t sectors_to_read);
+int disk_preadv(struct disk_t* pdisk, uint64_t offset, const struct iovec* iov,
+                int iovcnt);
 int disk_close(struct disk_t* pdisk);
 
 struct volume_t* fat_open(struct disk_t* pdisk, uint32_t first_sector);
+int volume_read(struct volume_t* pvolume, uint32_t first_sector, void* buffer,
+                uint32_t sectors_to_read);
+uint32_t cluster_sector(const struct volume_t* pvolume, uint16_t cluster);
 int fat_close(struct volume_t* pvolume);
 
 struct file_t* file_open(struct volume_t* pvolume, const char* file_name);
+struct file_t* file_open_entry(struct volume_t* pvolume, struct root_entry_t* entry);
 int file_close(struct file_t* stream);
 size_t file_read(void* ptr, size_t size, size_t nmemb, struct file_t* stream);
 int32_t file_seek(struct file_t* stream, int32_t offset, int whence);
+ssize_t file_readv(struct file_t* stream, const struct iovec* iov, const uint32_t* offsets,
+                   int iovcnt);
+int file_extents(struct file_t* stream, struct extent_t** extents, size_t* extents_n);
+
+int file_open_batch(struct volume_t* pvolume, const char** paths, size_t n,
+                    struct file_t** files, int* errors);
+int file_stat_batch(struct volume_t* pvolume, const char** paths, size_t n,
+                    struct file_stat_t* stats);
 
 struct dir_t* dir_open(struct volume_t* pvolume, const char* dir_path);
 int dir_read(struct dir_t* pdir, struct dir_entry_t* pentry);
+int dir_read_batch(struct dir_t* pdir, struct dir_record_t* records, size_t n);
 int dir_close(struct dir_t* pdir);
+uint8_t* clean_file_name(uint8_t* name, uint8_t* ext);
+void format_short_name(const uint8_t* name, const uint8_t* ext, char* out);
+bool make_short_name(const char* part, uint8_t* out);
+uint8_t* read_dir_entries(struct volume_t* pvolume, uint16_t first_cluster,
+                          struct root_entry_t*** entries, size_t* entries_n);
+int volume_walk(struct volume_t* pvolume, walk_callback_t callback, void* arg);
 
 #endif  // FAT_H
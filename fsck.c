@@ -0,0 +1,519 @@
+#include "fsck.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Directory waiting to be checked, its own chain is already claimed
+struct fsck_dir_t {
+    char* path;
+    uint32_t chain_id;
+    uint16_t* clusters;
+    uint32_t clusters_n;
+};
+
+struct fsck_state_t {
+    struct volume_t* volume;
+
+    // Id of the chain that claimed each cluster, 0 if none did. Every
+    // cluster is claimed exactly once with a compare-and-swap, so a second
+    // claim is either a loop or a cross-link.
+    atomic_uint_least32_t* owners;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct fsck_dir_t* queue;
+    size_t queue_n;
+    size_t queue_capacity;
+    // Directories that are queued or being checked
+    size_t pending;
+    int error;
+
+    // Chain ids index this, id 0 is unused
+    char** chain_paths;
+    size_t chain_paths_n;
+    size_t chain_paths_capacity;
+
+    struct fsck_report_t* report;
+};
+
+int add_problem(struct fsck_state_t* state, struct fsck_problem_t problem) {
+    struct fsck_report_t* report = state->report;
+
+    pthread_mutex_lock(&state->lock);
+
+    struct fsck_problem_t* newptr =
+        realloc(report->problems, (report->problems_n + 1) * sizeof(struct fsck_problem_t));
+    if (newptr == NULL) {
+        state->error = ENOMEM;
+        pthread_mutex_unlock(&state->lock);
+        free(problem.path);
+        free(problem.other_path);
+        return -1;
+    }
+
+    report->problems = newptr;
+    report->problems[report->problems_n++] = problem;
+
+    pthread_mutex_unlock(&state->lock);
+
+    return 0;
+}
+
+// Registers a path and returns the id its chain will claim clusters with
+uint32_t new_chain(struct fsck_state_t* state, const char* path) {
+    char* copy = strdup(path);
+    if (copy == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&state->lock);
+
+    if (state->chain_paths_n == state->chain_paths_capacity) {
+        size_t new_capacity = state->chain_paths_capacity * 2;
+        char** newptr = realloc(state->chain_paths, new_capacity * sizeof(char*));
+        if (newptr == NULL) {
+            state->error = ENOMEM;
+            pthread_mutex_unlock(&state->lock);
+            free(copy);
+            return 0;
+        }
+        state->chain_paths = newptr;
+        state->chain_paths_capacity = new_capacity;
+    }
+
+    uint32_t id = state->chain_paths_n;
+    state->chain_paths[state->chain_paths_n++] = copy;
+
+    pthread_mutex_unlock(&state->lock);
+
+    return id;
+}
+
+char* chain_path(struct fsck_state_t* state, uint32_t id) {
+    pthread_mutex_lock(&state->lock);
+    char* path = strdup(state->chain_paths[id]);
+    pthread_mutex_unlock(&state->lock);
+
+    return path;
+}
+
+// Walks and claims a chain. Returns the number of clusters that belong to it.
+// If `clusters` is not NULL the cluster numbers are returned there as well.
+uint32_t claim_chain(struct fsck_state_t* state, const char* path, uint32_t id,
+                     uint16_t first_cluster, uint16_t** clusters) {
+    struct volume_t* volume = state->volume;
+    uint32_t length = 0;
+    uint32_t capacity = 0;
+    uint16_t cluster = first_cluster;
+
+    if (clusters != NULL) *clusters = NULL;
+
+    while (true) {
+        if (cluster < 2 || cluster >= volume->clusters_n) {
+            add_problem(state, (struct fsck_problem_t){
+                                   .type = FSCK_BAD_CHAIN,
+                                   .path = strdup(path),
+                                   .cluster = cluster,
+                               });
+            break;
+        }
+
+        uint_least32_t expected = 0;
+        if (!atomic_compare_exchange_strong(&state->owners[cluster], &expected, id)) {
+            bool loop = expected == id;
+            add_problem(state, (struct fsck_problem_t){
+                                   .type = loop ? FSCK_LOOP : FSCK_CROSS_LINK,
+                                   .path = strdup(path),
+                                   .other_path = loop ? NULL : chain_path(state, expected),
+                                   .cluster = cluster,
+                               });
+            break;
+        }
+
+        if (clusters != NULL) {
+            if (length == capacity) {
+                capacity = capacity == 0 ? 8 : capacity * 2;
+                uint16_t* newptr = realloc(*clusters, capacity * sizeof(uint16_t));
+                if (newptr == NULL) {
+                    pthread_mutex_lock(&state->lock);
+                    state->error = ENOMEM;
+                    pthread_mutex_unlock(&state->lock);
+                    break;
+                }
+                *clusters = newptr;
+            }
+            (*clusters)[length] = cluster;
+        }
+
+        length++;
+
+        uint16_t next = volume->fat[cluster];
+        if (next >= 0xFFF8) break;
+
+        // Free (0) and bad (0xFFF7) clusters can't be part of a chain
+        if (next == 0 || next == 0xFFF7) {
+            add_problem(state, (struct fsck_problem_t){
+                                   .type = FSCK_BAD_CHAIN,
+                                   .path = strdup(path),
+                                   .cluster = next,
+                               });
+            break;
+        }
+
+        cluster = next;
+    }
+
+    return length;
+}
+
+int queue_dir(struct fsck_state_t* state, struct fsck_dir_t dir) {
+    pthread_mutex_lock(&state->lock);
+
+    if (state->queue_n == state->queue_capacity) {
+        size_t new_capacity = state->queue_capacity == 0 ? 64 : state->queue_capacity * 2;
+        struct fsck_dir_t* newptr = realloc(state->queue, new_capacity * sizeof(struct fsck_dir_t));
+        if (newptr == NULL) {
+            state->error = ENOMEM;
+            pthread_mutex_unlock(&state->lock);
+            free(dir.path);
+            free(dir.clusters);
+            return -1;
+        }
+        state->queue = newptr;
+        state->queue_capacity = new_capacity;
+    }
+
+    state->queue[state->queue_n++] = dir;
+    state->pending++;
+    pthread_cond_signal(&state->cond);
+
+    pthread_mutex_unlock(&state->lock);
+
+    return 0;
+}
+
+void check_entries(struct fsck_state_t* state, const char* dir_path,
+                   struct root_entry_t* entries, size_t entries_n) {
+    struct volume_t* volume = state->volume;
+    size_t dir_path_len = strlen(dir_path);
+    size_t files = 0;
+    size_t dirs = 0;
+
+    for (size_t i = 0; i < entries_n; i++) {
+        struct root_entry_t* entry = &entries[i];
+
+        if (entry->name[0] == 0) break;
+        if (entry->name[0] == 0xE5 || entry->attributes == 0x0F) continue;
+        if ((entry->attributes >> 3) & 1) continue;
+        if (entry->name[0] == '.') continue;
+
+        uint8_t* name = clean_file_name(entry->name, entry->ext);
+        if (name == NULL) continue;
+
+        char path[dir_path_len + 14];
+        memcpy(path, dir_path, dir_path_len);
+        path[dir_path_len] = '\\';
+        strcpy(path + dir_path_len + 1, (char*)name);
+        free(name);
+
+        bool is_dir = (entry->attributes >> 4) & 1;
+
+        if (is_dir) {
+            dirs++;
+
+            if (entry->first_cluster == 0) {
+                add_problem(state, (struct fsck_problem_t){
+                                       .type = FSCK_BAD_CHAIN,
+                                       .path = strdup(path),
+                                       .cluster = 0,
+                                   });
+                continue;
+            }
+
+            uint32_t id = new_chain(state, path);
+            if (id == 0) continue;
+
+            // Subdirectories are checked by whichever worker is free
+            struct fsck_dir_t dir = {.path = strdup(path), .chain_id = id};
+            dir.clusters_n = claim_chain(state, path, id, entry->first_cluster, &dir.clusters);
+
+            if (dir.path == NULL || dir.clusters_n == 0) {
+                free(dir.path);
+                free(dir.clusters);
+                continue;
+            }
+
+            queue_dir(state, dir);
+            continue;
+        }
+
+        files++;
+
+        uint32_t expected = ((uint64_t)entry->size + volume->bytes_per_cluster - 1) >>
+                            volume->cluster_shift;
+        uint32_t length = 0;
+
+        if (entry->first_cluster != 0) {
+            uint32_t id = new_chain(state, path);
+            if (id == 0) continue;
+            length = claim_chain(state, path, id, entry->first_cluster, NULL);
+        }
+
+        if (length != expected) {
+            add_problem(state, (struct fsck_problem_t){
+                                   .type = FSCK_SIZE_MISMATCH,
+                                   .path = strdup(path),
+                                   .cluster = entry->first_cluster,
+                                   .clusters = length,
+                                   .expected_clusters = expected,
+                               });
+        }
+    }
+
+    pthread_mutex_lock(&state->lock);
+    state->report->files += files;
+    state->report->dirs += dirs;
+    pthread_mutex_unlock(&state->lock);
+}
+
+void check_dir(struct fsck_state_t* state, struct fsck_dir_t* dir) {
+    struct volume_t* volume = state->volume;
+    uint8_t cluster_shift = volume->cluster_shift;
+
+    uint8_t* buf = malloc((size_t)dir->clusters_n << cluster_shift);
+    if (buf == NULL) {
+        pthread_mutex_lock(&state->lock);
+        state->error = ENOMEM;
+        pthread_mutex_unlock(&state->lock);
+        return;
+    }
+
+    for (uint32_t i = 0; i < dir->clusters_n; i++) {
+        uint32_t sector = cluster_sector(volume, dir->clusters[i]);
+        if (volume_read(volume, sector, buf + ((size_t)i << cluster_shift),
+                      volume->sectors_per_cluster) == -1) {
+            pthread_mutex_lock(&state->lock);
+            state->error = errno;
+            pthread_mutex_unlock(&state->lock);
+            free(buf);
+            return;
+        }
+    }
+
+    check_entries(state, dir->path, (struct root_entry_t*)buf,
+                  ((size_t)dir->clusters_n << cluster_shift) / sizeof(struct root_entry_t));
+
+    free(buf);
+}
+
+void* fsck_worker(void* arg) {
+    struct fsck_state_t* state = arg;
+
+    pthread_mutex_lock(&state->lock);
+
+    while (true) {
+        while (state->queue_n == 0 && state->pending > 0) {
+            pthread_cond_wait(&state->cond, &state->lock);
+        }
+
+        if (state->queue_n == 0) break;
+
+        struct fsck_dir_t dir = state->queue[--state->queue_n];
+        pthread_mutex_unlock(&state->lock);
+
+        check_dir(state, &dir);
+        free(dir.path);
+        free(dir.clusters);
+
+        pthread_mutex_lock(&state->lock);
+        if (--state->pending == 0) {
+            pthread_cond_broadcast(&state->cond);
+        }
+    }
+
+    pthread_mutex_unlock(&state->lock);
+
+    return NULL;
+}
+
+void find_lost_clusters(struct fsck_state_t* state) {
+    struct volume_t* volume = state->volume;
+    struct fsck_report_t* report = state->report;
+    uint32_t run_start = 0;
+    uint32_t run_length = 0;
+
+    for (uint32_t cluster = 2; cluster <= volume->clusters_n; cluster++) {
+        bool lost = false;
+
+        if (cluster < volume->clusters_n) {
+            uint16_t value = volume->fat[cluster];
+            bool owned = atomic_load(&state->owners[cluster]) != 0;
+
+            if (owned) {
+                report->clusters_used++;
+            } else if (value == 0) {
+                report->clusters_free++;
+            } else if (value != 0xFFF7) {
+                report->clusters_lost++;
+                lost = true;
+            }
+        }
+
+        // Consecutive lost clusters are reported as one run
+        if (lost) {
+            if (run_length == 0) run_start = cluster;
+            run_length++;
+        } else if (run_length > 0) {
+            add_problem(state, (struct fsck_problem_t){
+                                   .type = FSCK_LOST_CLUSTERS,
+                                   .cluster = run_start,
+                                   .clusters = run_length,
+                               });
+            run_length = 0;
+        }
+    }
+}
+
+// Validates every chain on the volume. Each cluster may be claimed by one
+// chain only, which catches loops and cross-links in a single pass, and
+// subdirectories are checked in parallel. Returns -1 only if the check itself
+// couldn't complete, problems with the volume are listed in `report`.
+int fsck_volume(struct volume_t* pvolume, unsigned threads, struct fsck_report_t* report) {
+    if (pvolume == NULL || report == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    memset(report, 0, sizeof(struct fsck_report_t));
+
+    struct fsck_state_t state = {
+        .volume = pvolume,
+        .report = report,
+        .chain_paths_capacity = 64,
+        // Id 0 means unclaimed
+        .chain_paths_n = 1,
+    };
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.cond, NULL);
+
+    state.owners = calloc(pvolume->clusters_n > 0 ? pvolume->clusters_n : 1,
+                          sizeof(atomic_uint_least32_t));
+    state.chain_paths = calloc(state.chain_paths_capacity, sizeof(char*));
+    if (state.owners == NULL || state.chain_paths == NULL) {
+        free(state.owners);
+        free(state.chain_paths);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    // The root dir has a fixed location, only its entries need checking
+    struct root_entry_t* root_entries = (struct root_entry_t*)pvolume->root_dir;
+    check_entries(&state, "", root_entries, pvolume->boot_record->root_entries);
+
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (unsigned)cpus : 1;
+    }
+
+    pthread_t* thread_ids = calloc(threads, sizeof(pthread_t));
+    unsigned started = 0;
+    if (thread_ids != NULL) {
+        for (; started < threads - 1; started++) {
+            if (pthread_create(&thread_ids[started], NULL, fsck_worker, &state) != 0) {
+                break;
+            }
+        }
+    }
+
+    fsck_worker(&state);
+
+    for (unsigned i = 0; i < started; i++) {
+        pthread_join(thread_ids[i], NULL);
+    }
+    free(thread_ids);
+
+    find_lost_clusters(&state);
+
+    for (size_t i = 0; i < state.chain_paths_n; i++) {
+        free(state.chain_paths[i]);
+    }
+    free(state.chain_paths);
+    free(state.owners);
+    free(state.queue);
+    pthread_mutex_destroy(&state.lock);
+    pthread_cond_destroy(&state.cond);
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    report->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    if (state.error != 0) {
+        fsck_free(report);
+        errno = state.error;
+        return -1;
+    }
+
+    return 0;
+}
+
+int fsck_print(FILE* out, struct fsck_report_t* report) {
+    if (out == NULL || report == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    for (size_t i = 0; i < report->problems_n; i++) {
+        struct fsck_problem_t* problem = &report->problems[i];
+
+        switch (problem->type) {
+            case FSCK_LOST_CLUSTERS:
+                fprintf(out, "lost clusters %u-%u\n", problem->cluster,
+                        problem->cluster + problem->clusters - 1);
+                break;
+            case FSCK_CROSS_LINK:
+                fprintf(out, "%s: cross-linked with %s at cluster %u\n", problem->path,
+                        problem->other_path != NULL ? problem->other_path : "?",
+                        problem->cluster);
+                break;
+            case FSCK_LOOP:
+                fprintf(out, "%s: chain loops back to cluster %u\n", problem->path,
+                        problem->cluster);
+                break;
+            case FSCK_BAD_CHAIN:
+                fprintf(out, "%s: chain points to invalid cluster %u\n", problem->path,
+                        problem->cluster);
+                break;
+            case FSCK_SIZE_MISMATCH:
+                fprintf(out, "%s: chain has %u clusters, size needs %u\n", problem->path,
+                        problem->clusters, problem->expected_clusters);
+                break;
+        }
+    }
+
+    fprintf(out, "%zu files, %zu dirs, %u used, %u free, %u lost clusters, %zu problems in %.3fs\n",
+            report->files, report->dirs, report->clusters_used, report->clusters_free,
+            report->clusters_lost, report->problems_n, report->seconds);
+
+    return ferror(out) ? -1 : 0;
+}
+
+void fsck_free(struct fsck_report_t* report) {
+    if (report == NULL) return;
+
+    for (size_t i = 0; i < report->problems_n; i++) {
+        free(report->problems[i].path);
+        free(report->problems[i].other_path);
+    }
+    free(report->problems);
+    report->problems = NULL;
+    report->problems_n = 0;
+}
@@ -0,0 +1,50 @@
+#ifndef FSCK_H
+#define FSCK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "file_reader.h"
+
+enum fsck_problem_type_t {
+    // Allocated clusters that no file or directory points to
+    FSCK_LOST_CLUSTERS,
+    // Chain runs into a cluster that belongs to another chain
+    FSCK_CROSS_LINK,
+    // Chain runs back into itself
+    FSCK_LOOP,
+    // Chain points to a free, bad or out of range cluster
+    FSCK_BAD_CHAIN,
+    // Number of clusters in the chain doesn't match the size in the entry
+    FSCK_SIZE_MISMATCH,
+};
+
+struct fsck_problem_t {
+    enum fsck_problem_type_t type;
+    // Path of the affected file or directory, NULL for lost clusters
+    char* path;
+    // Other owner of the cluster for cross-links
+    char* other_path;
+    uint16_t cluster;
+    // Chain length for size mismatches, run length for lost clusters
+    uint32_t clusters;
+    uint32_t expected_clusters;
+};
+
+struct fsck_report_t {
+    struct fsck_problem_t* problems;
+    size_t problems_n;
+    size_t files;
+    size_t dirs;
+    uint32_t clusters_used;
+    uint32_t clusters_free;
+    uint32_t clusters_lost;
+    double seconds;
+};
+
+int fsck_volume(struct volume_t* pvolume, unsigned threads, struct fsck_report_t* report);
+int fsck_print(FILE* out, struct fsck_report_t* report);
+void fsck_free(struct fsck_report_t* report);
+
+#endif  // FSCK_H
@@ -0,0 +1,425 @@
+#include "hash.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HASH_X86
+#endif
+
+#include "volume_files.h"
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4,
+    0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe,
+    0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f,
+    0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+    0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116,
+    0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7,
+    0xc67178f2,
+};
+
+static uint32_t crc32c_table[256];
+
+static void (*sha256_blocks)(uint32_t* state, const uint8_t* data, size_t blocks);
+static uint32_t (*crc32c_blocks)(uint32_t crc, const uint8_t* data, size_t len);
+static pthread_once_t hash_once = PTHREAD_ONCE_INIT;
+
+uint32_t crc32c_sw(uint32_t crc, const uint8_t* data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        crc = crc32c_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256_blocks_sw(uint32_t* state, const uint8_t* data, size_t blocks) {
+    uint32_t w[64];
+
+    while (blocks--) {
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t)data[i * 4] << 24 | (uint32_t)data[i * 4 + 1] << 16 |
+                   (uint32_t)data[i * 4 + 2] << 8 | (uint32_t)data[i * 4 + 3];
+        }
+
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+        for (int i = 0; i < 64; i++) {
+            uint32_t s1 = ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25);
+            uint32_t ch = (e & f) ^ (~e & g);
+            uint32_t t1 = h + s1 + ch + sha256_k[i] + w[i];
+            uint32_t s0 = ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22);
+            uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+            uint32_t t2 = s0 + maj;
+
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+
+        data += 64;
+    }
+}
+
+#ifdef HASH_X86
+__attribute__((target("sse4.2"))) uint32_t crc32c_hw(uint32_t crc, const uint8_t* data,
+                                                      size_t len) {
+    uint64_t crc64 = crc;
+    while (len >= 8) {
+        uint64_t value;
+        memcpy(&value, data, 8);
+        crc64 = _mm_crc32_u64(crc64, value);
+        data += 8;
+        len -= 8;
+    }
+
+    crc = (uint32_t)crc64;
+    while (len--) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+
+    return crc;
+}
+
+// SHA extensions keep the state as ABEF/CDGH pairs and run two rounds per
+// instruction, the message schedule is built four words at a time
+__attribute__((target("sha,sse4.1"))) void sha256_blocks_hw(uint32_t* state,
+                                                             const uint8_t* data,
+                                                             size_t blocks) {
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    __m128i tmp = _mm_loadu_si128((const __m128i*)&state[0]);
+    __m128i state1 = _mm_loadu_si128((const __m128i*)&state[4]);
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);
+    state1 = _mm_shuffle_epi32(state1, 0x1B);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    while (blocks--) {
+        __m128i abef_save = state0;
+        __m128i cdgh_save = state1;
+        __m128i w[4];
+
+        for (int i = 0; i < 16; i++) {
+            if (i < 4) {
+                w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + i * 16)), mask);
+            } else {
+                __m128i next = _mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]);
+                next = _mm_add_epi32(next, _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4));
+                w[i & 3] = _mm_sha256msg2_epu32(next, w[(i + 3) & 3]);
+            }
+
+            __m128i msg =
+                _mm_add_epi32(w[i & 3], _mm_loadu_si128((const __m128i*)&sha256_k[i * 4]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            msg = _mm_shuffle_epi32(msg, 0x0E);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+        }
+
+        state0 = _mm_add_epi32(state0, abef_save);
+        state1 = _mm_add_epi32(state1, cdgh_save);
+
+        data += 64;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+    _mm_storeu_si128((__m128i*)&state[0], state0);
+    _mm_storeu_si128((__m128i*)&state[4], state1);
+}
+#endif
+
+void hash_init_once(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++) {
+            crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+        }
+        crc32c_table[i] = crc;
+    }
+
+    crc32c_blocks = crc32c_sw;
+    sha256_blocks = sha256_blocks_sw;
+
+#ifdef HASH_X86
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        bool has_sse42 = (ecx >> 20) & 1;
+        bool has_sse41 = (ecx >> 19) & 1;
+        bool has_ssse3 = (ecx >> 9) & 1;
+
+        if (has_sse42) crc32c_blocks = crc32c_hw;
+
+        if (has_sse41 && has_ssse3 && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) &&
+            ((ebx >> 29) & 1)) {
+            sha256_blocks = sha256_blocks_hw;
+        }
+    }
+#endif
+}
+
+uint32_t crc32c_update(uint32_t crc, const void* data, size_t len) {
+    pthread_once(&hash_once, hash_init_once);
+
+    return ~crc32c_blocks(~crc, data, len);
+}
+
+void sha256_init(struct sha256_t* ctx) {
+    static const uint32_t initial_state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+
+    pthread_once(&hash_once, hash_init_once);
+
+    memcpy(ctx->state, initial_state, sizeof(initial_state));
+    ctx->length = 0;
+    ctx->block_len = 0;
+}
+
+void sha256_update(struct sha256_t* ctx, const void* data, size_t len) {
+    const uint8_t* in = data;
+    ctx->length += len;
+
+    if (ctx->block_len > 0) {
+        size_t n = 64 - ctx->block_len < len ? 64 - ctx->block_len : len;
+        memcpy(ctx->block + ctx->block_len, in, n);
+        ctx->block_len += n;
+        in += n;
+        len -= n;
+
+        if (ctx->block_len < 64) return;
+
+        sha256_blocks(ctx->state, ctx->block, 1);
+        ctx->block_len = 0;
+    }
+
+    // Whole blocks are hashed straight from the caller's buffer
+    if (len >= 64) {
+        sha256_blocks(ctx->state, in, len / 64);
+        in += len & ~(size_t)63;
+        len &= 63;
+    }
+
+    memcpy(ctx->block, in, len);
+    ctx->block_len = len;
+}
+
+void sha256_final(struct sha256_t* ctx, uint8_t* digest) {
+    uint64_t bits = ctx->length * 8;
+
+    ctx->block[ctx->block_len++] = 0x80;
+    if (ctx->block_len > 56) {
+        memset(ctx->block + ctx->block_len, 0, 64 - ctx->block_len);
+        sha256_blocks(ctx->state, ctx->block, 1);
+        ctx->block_len = 0;
+    }
+
+    memset(ctx->block + ctx->block_len, 0, 56 - ctx->block_len);
+    for (int i = 0; i < 8; i++) {
+        ctx->block[56 + i] = bits >> (56 - i * 8);
+    }
+    sha256_blocks(ctx->state, ctx->block, 1);
+
+    for (int i = 0; i < 8; i++) {
+        digest[i * 4] = ctx->state[i] >> 24;
+        digest[i * 4 + 1] = ctx->state[i] >> 16;
+        digest[i * 4 + 2] = ctx->state[i] >> 8;
+        digest[i * 4 + 3] = ctx->state[i];
+    }
+}
+
+struct hash_job_t {
+    struct volume_t* volume;
+    struct volume_file_t* files;
+    struct hash_record_t* records;
+};
+
+int hash_file(struct volume_t* pvolume, struct root_entry_t* entry,
+              struct hash_record_t* record, uint8_t* chunk) {
+    struct file_t* file = file_open_entry(pvolume, entry);
+    if (file == NULL) {
+        return -1;
+    }
+
+    struct extent_t* extents = NULL;
+    size_t extents_n = 0;
+    if (file_extents(file, &extents, &extents_n) == -1) {
+        file_close(file);
+        return -1;
+    }
+
+    struct sha256_t sha;
+    sha256_init(&sha);
+    uint32_t crc = 0;
+
+    uint8_t sector_shift = pvolume->sector_shift;
+    uint32_t chunk_sectors = HASH_CHUNK_SIZE >> sector_shift;
+    uint32_t bytes_left = entry->size;
+    int result = 0;
+
+    for (size_t i = 0; i < extents_n && bytes_left > 0; i++) {
+        uint32_t sector = extents[i].sector;
+        uint32_t sectors_left = extents[i].sectors;
+
+        while (sectors_left > 0 && bytes_left > 0) {
+            uint32_t sectors = sectors_left < chunk_sectors ? sectors_left : chunk_sectors;
+
+            if (volume_read(pvolume, sector, chunk, sectors) == -1) {
+                result = -1;
+                break;
+            }
+
+            uint32_t n = sectors << sector_shift;
+            if (n > bytes_left) n = bytes_left;
+
+            crc = crc32c_update(crc, chunk, n);
+            sha256_update(&sha, chunk, n);
+
+            sector += sectors;
+            sectors_left -= sectors;
+            bytes_left -= n;
+        }
+
+        if (result == -1) break;
+    }
+
+    // A chain shorter than the size in the entry can't be hashed completely
+    if (result == 0 && bytes_left > 0) {
+        errno = EIO;
+        result = -1;
+    }
+
+    if (result == 0) {
+        record->crc32c = crc;
+        sha256_final(&sha, record->sha256);
+    }
+
+    free(extents);
+    file_close(file);
+
+    return result;
+}
+
+void hash_worker(size_t index, uint8_t* chunk, void* arg) {
+    struct hash_job_t* job = arg;
+
+    if (hash_file(job->volume, &job->files[index].entry, &job->records[index], chunk) == -1) {
+        job->records[index].error = errno;
+    }
+}
+
+// Hashes every file on the volume with CRC32C and SHA-256. Records are in
+// directory walk order and must be freed with `hash_free`.
+int hash_volume(struct volume_t* pvolume, unsigned threads, struct hash_record_t** records,
+                size_t* records_n) {
+    if (pvolume == NULL || records == NULL || records_n == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    struct volume_file_t* files;
+    size_t files_n;
+    if (volume_files_collect(pvolume, &files, &files_n) == -1) {
+        return -1;
+    }
+
+    struct hash_record_t* out = calloc(files_n > 0 ? files_n : 1, sizeof(struct hash_record_t));
+    if (out == NULL) {
+        volume_files_free(files, files_n);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    struct hash_job_t job = {
+        .volume = pvolume,
+        .files = files,
+        .records = out,
+    };
+
+    if (volume_files_run(files_n, threads, HASH_CHUNK_SIZE, hash_worker, &job) == -1) {
+        free(out);
+        volume_files_free(files, files_n);
+        return -1;
+    }
+
+    // The records take over the paths
+    for (size_t i = 0; i < files_n; i++) {
+        out[i].path = files[i].path;
+        out[i].size = files[i].entry.size;
+    }
+    free(files);
+
+    *records = out;
+    *records_n = files_n;
+
+    return 0;
+}
+
+// One line per file: sha256, crc32c, size and path. Files that couldn't be
+// read get dashes instead of digests.
+int hash_write_manifest(FILE* out, struct hash_record_t* records, size_t records_n) {
+    if (out == NULL || (records == NULL && records_n > 0)) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    for (size_t i = 0; i < records_n; i++) {
+        struct hash_record_t* record = &records[i];
+
+        if (record->error != 0) {
+            fprintf(out, "%64s %8s %10u %s\n", "-", "-", record->size, record->path);
+            continue;
+        }
+
+        for (int j = 0; j < 32; j++) {
+            fprintf(out, "%02x", record->sha256[j]);
+        }
+        fprintf(out, " %08x %10u %s\n", record->crc32c, record->size, record->path);
+    }
+
+    return ferror(out) ? -1 : 0;
+}
+
+void hash_free(struct hash_record_t* records, size_t records_n) {
+    if (records == NULL) return;
+
+    for (size_t i = 0; i < records_n; i++) {
+        free(records[i].path);
+    }
+    free(records);
+}
@@ -0,0 +1,41 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "file_reader.h"
+
+// Files are streamed through the hashes in chunks of this size, a file is
+// never held in memory as a whole
+#define HASH_CHUNK_SIZE (256 * 1024)
+
+struct sha256_t {
+    uint32_t state[8];
+    uint64_t length;
+    uint8_t block[64];
+    size_t block_len;
+};
+
+struct hash_record_t {
+    char* path;
+    uint32_t size;
+    uint32_t crc32c;
+    uint8_t sha256[32];
+    // 0 on success, otherwise the errno value for this file
+    int error;
+};
+
+uint32_t crc32c_update(uint32_t crc, const void* data, size_t len);
+
+void sha256_init(struct sha256_t* ctx);
+void sha256_update(struct sha256_t* ctx, const void* data, size_t len);
+void sha256_final(struct sha256_t* ctx, uint8_t* digest);
+
+int hash_volume(struct volume_t* pvolume, unsigned threads, struct hash_record_t** records,
+                size_t* records_n);
+int hash_write_manifest(FILE* out, struct hash_record_t* records, size_t records_n);
+void hash_free(struct hash_record_t* records, size_t records_n);
+
+#endif  // HASH_H
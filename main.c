@@ -2,9 +2,437 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "compressed_disk.h"
+#include "diff.h"
 #include "file_reader.h"
+#include "fsck.h"
+#include "hash.h"
+#include "recover.h"
+#include "scan.h"
+#include "search.h"
+#include "sidecar.h"
+
+int read_whole_file(const struct scan_file_t* file, void* arg) {
+    (void)arg;
+
+    uint8_t* buf = malloc(file->file->size > 0 ? file->file->size : 1);
+    if (buf == NULL) {
+        return -1;
+    }
+
+    size_t n = file_read(buf, 1, file->file->size, file->file);
+    free(buf);
+
+    return n == file->file->size ? 0 : -1;
+}
+
+// Usage: fat16 scan [-j threads] image...
+int scan_command(int argc, char** argv) {
+    unsigned threads = 0;
+    if (argc >= 2 && strcmp(argv[0], "-j") == 0) {
+        threads = atoi(argv[1]);
+        argc -= 2;
+        argv += 2;
+    }
+
+    struct scan_stats_t stats;
+    if (scan_images((const char**)argv, argc, threads, read_whole_file, NULL, &stats) == -1) {
+        perror("scan_images");
+        return 1;
+    }
+
+    double seconds = stats.seconds > 0 ? stats.seconds : 1e-9;
+    printf("images=%zu failed=%zu dirs=%zu files=%zu errors=%zu loops=%zu\n", stats.images,
+           stats.images_failed, stats.dirs, stats.files, stats.visitor_errors, stats.dir_loops);
+    printf("%.3fs, %.0f images/s, %.0f files/s, %.2f MiB/s\n", stats.seconds,
+           stats.images / seconds, stats.files / seconds,
+           stats.bytes / seconds / (1024 * 1024));
+
+    return 0;
+}
+
+// Usage: fat16 hash [-j threads] image
+int hash_command(int argc, char** argv) {
+    unsigned threads = 0;
+    if (argc >= 2 && strcmp(argv[0], "-j") == 0) {
+        threads = atoi(argv[1]);
+        argc -= 2;
+        argv += 2;
+    }
+
+    if (argc != 1) {
+        fprintf(stderr, "usage: fat16 hash [-j threads] image\n");
+        return 1;
+    }
+
+    struct disk_t* disk = disk_open_from_file(argv[0]);
+    if (disk == NULL) {
+        perror("disk_open_from_file");
+        return 1;
+    }
+
+    struct volume_t* volume = fat_open(disk, 0);
+    if (volume == NULL) {
+        perror("fat_open");
+        disk_close(disk);
+        return 1;
+    }
+
+    struct hash_record_t* records;
+    size_t records_n;
+    int result = hash_volume(volume, threads, &records, &records_n);
+    if (result == -1) {
+        perror("hash_volume");
+    } else {
+        result = hash_write_manifest(stdout, records, records_n);
+        hash_free(records, records_n);
+    }
+
+    fat_close(volume);
+    disk_close(disk);
+
+    return result == 0 ? 0 : 1;
+}
+
+// Usage: fat16 compress image output [chunk_size]
+int compress_command(int argc, char** argv) {
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "usage: fat16 compress image output [chunk_size]\n");
+        return 1;
+    }
+
+    uint32_t chunk_size = argc == 3 ? strtoul(argv[2], NULL, 0) : 0;
+    if (compressed_disk_convert(argv[0], argv[1], chunk_size) == -1) {
+        perror("compressed_disk_convert");
+        return 1;
+    }
+
+    return 0;
+}
+
+// Usage: fat16 fsck [-j threads] image
+int fsck_command(int argc, char** argv) {
+    unsigned threads = 0;
+    if (argc >= 2 && strcmp(argv[0], "-j") == 0) {
+        threads = atoi(argv[1]);
+        argc -= 2;
+        argv += 2;
+    }
+
+    if (argc != 1) {
+        fprintf(stderr, "usage: fat16 fsck [-j threads] image\n");
+        return 1;
+    }
+
+    struct disk_t* disk = disk_open_from_file(argv[0]);
+    if (disk == NULL) {
+        perror("disk_open_from_file");
+        return 1;
+    }
+
+    struct volume_t* volume = fat_open(disk, 0);
+    if (volume == NULL) {
+        perror("fat_open");
+        disk_close(disk);
+        return 1;
+    }
+
+    struct fsck_report_t report;
+    int result = fsck_volume(volume, threads, &report);
+    if (result == -1) {
+        perror("fsck_volume");
+    } else {
+        fsck_print(stdout, &report);
+        result = report.problems_n > 0 ? -1 : 0;
+        fsck_free(&report);
+    }
+
+    fat_close(volume);
+    disk_close(disk);
+
+    return result == 0 ? 0 : 1;
+}
+
+// Usage: fat16 index image
+int index_command(int argc, char** argv) {
+    if (argc != 1) {
+        fprintf(stderr, "usage: fat16 index image\n");
+        return 1;
+    }
+
+    struct disk_t* disk = disk_open_from_file(argv[0]);
+    if (disk == NULL) {
+        perror("disk_open_from_file");
+        return 1;
+    }
+
+    struct volume_t* volume = fat_open(disk, 0);
+    if (volume == NULL) {
+        perror("fat_open");
+        disk_close(disk);
+        return 1;
+    }
+
+    size_t sidecar_name_len = strlen(argv[0]) + sizeof(SIDECAR_SUFFIX);
+    char sidecar_name[sidecar_name_len];
+    snprintf(sidecar_name, sidecar_name_len, "%s%s", argv[0], SIDECAR_SUFFIX);
+
+    int result = sidecar_build(volume, sidecar_name);
+    if (result == -1) {
+        perror("sidecar_build");
+    }
+
+    fat_close(volume);
+    disk_close(disk);
+
+    return result == 0 ? 0 : 1;
+}
+
+// Usage: fat16 recover image [-x output_dir]
+int recover_command(int argc, char** argv) {
+    const char* output_dir = NULL;
+    if (argc == 3 && strcmp(argv[1], "-x") == 0) {
+        output_dir = argv[2];
+        argc -= 2;
+    }
+
+    if (argc != 1) {
+        fprintf(stderr, "usage: fat16 recover image [-x output_dir]\n");
+        return 1;
+    }
+
+    struct disk_t* disk = disk_open_from_file(argv[0]);
+    if (disk == NULL) {
+        perror("disk_open_from_file");
+        return 1;
+    }
+
+    struct volume_t* volume = fat_open(disk, 0);
+    if (volume == NULL) {
+        perror("fat_open");
+        disk_close(disk);
+        return 1;
+    }
+
+    struct recover_entry_t* entries;
+    size_t entries_n;
+    int result = recover_scan(volume, &entries, &entries_n);
+    if (result == -1) {
+        perror("recover_scan");
+        entries_n = 0;
+        entries = NULL;
+    }
+
+    const char* states[] = {"intact", "partial", "overwritten"};
+
+    for (size_t i = 0; i < entries_n; i++) {
+        struct recover_entry_t* entry = &entries[i];
+        printf("%12s size=%10u cluster=%5u dir=%5u %s (%u/%u clusters free)\n", entry->name,
+               entry->size, entry->first_cluster, entry->dir_cluster, states[entry->state],
+               entry->free_clusters, entry->clusters);
+
+        // Only files that are still whole are worth extracting
+        if (output_dir == NULL || entry->state != RECOVER_INTACT ||
+            (entry->attributes >> 4) & 1) {
+            continue;
+        }
+
+        char path[strlen(output_dir) + 32];
+        snprintf(path, sizeof(path), "%s/%u_%s", output_dir, entry->dir_cluster, entry->name);
+
+        FILE* out = fopen(path, "w");
+        if (out == NULL || recover_extract(volume, entry, out) == -1) {
+            perror(path);
+            result = -1;
+        }
+        if (out != NULL) fclose(out);
+    }
+
+    free(entries);
+    fat_close(volume);
+    disk_close(disk);
+
+    return result == 0 ? 0 : 1;
+}
+
+// Decodes a hex string such as "deadbeef" in place, returns the length or -1
+int parse_hex(char* text) {
+    size_t len = strlen(text);
+    if (len == 0 || len % 2 != 0) return -1;
+
+    for (size_t i = 0; i < len; i += 2) {
+        char byte[3] = {text[i], text[i + 1], '\0'};
+        char* end;
+        long value = strtol(byte, &end, 16);
+        if (*end != '\0') return -1;
+        text[i / 2] = (char)value;
+    }
+
+    return (int)(len / 2);
+}
+
+// Usage: fat16 search [-j threads] [-x] image pattern...
+int search_command(int argc, char** argv) {
+    unsigned threads = 0;
+    if (argc >= 2 && strcmp(argv[0], "-j") == 0) {
+        threads = atoi(argv[1]);
+        argc -= 2;
+        argv += 2;
+    }
+
+    bool hex = false;
+    if (argc >= 1 && strcmp(argv[0], "-x") == 0) {
+        hex = true;
+        argc--;
+        argv++;
+    }
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: fat16 search [-j threads] [-x] image pattern...\n");
+        return 1;
+    }
+
+    size_t patterns_n = argc - 1;
+    struct search_pattern_t patterns[patterns_n];
+    for (size_t i = 0; i < patterns_n; i++) {
+        // Keep the text for printing, hex patterns are decoded into a copy
+        char* text = argv[i + 1];
+        if (hex) {
+            text = strdup(text);
+            int length = text != NULL ? parse_hex(text) : -1;
+            if (length == -1) {
+                fprintf(stderr, "bad hex pattern: %s\n", argv[i + 1]);
+                free(text);
+                for (size_t j = 0; j < i; j++) free((void*)patterns[j].data);
+                return 1;
+            }
+            patterns[i].length = length;
+        } else {
+            patterns[i].length = strlen(text);
+        }
+        patterns[i].data = (const uint8_t*)text;
+    }
+
+    int result = -1;
+    struct volume_t* volume = NULL;
+    struct disk_t* disk = disk_open_from_file(argv[0]);
+    if (disk == NULL) {
+        perror("disk_open_from_file");
+        goto done;
+    }
+
+    volume = fat_open(disk, 0);
+    if (volume == NULL) {
+        perror("fat_open");
+        goto done;
+    }
+
+    struct search_match_t* matches;
+    size_t matches_n;
+    result = search_volume(volume, patterns, patterns_n, threads, &matches, &matches_n);
+    if (result == -1) {
+        perror("search_volume");
+        goto done;
+    }
+
+    for (size_t i = 0; i < matches_n; i++) {
+        struct search_match_t* match = &matches[i];
+
+        if (match->error != 0) {
+            fprintf(stderr, "%s: %s\n", match->path, strerror(match->error));
+            result = -1;
+            continue;
+        }
+
+        printf("%s:%u: %s\n", match->path, match->offset, argv[match->pattern + 1]);
+    }
+
+    search_free(matches, matches_n);
+
+done:
+    if (volume != NULL) fat_close(volume);
+    if (disk != NULL) disk_close(disk);
+    if (hex) {
+        for (size_t i = 0; i < patterns_n; i++) free((void*)patterns[i].data);
+    }
+
+    return result == 0 ? 0 : 1;
+}
+
+// Usage: fat16 diff old_image new_image
+int diff_command(int argc, char** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: fat16 diff old_image new_image\n");
+        return 1;
+    }
+
+    struct disk_t* disks[2] = {NULL, NULL};
+    struct volume_t* volumes[2] = {NULL, NULL};
+    int result = -1;
+
+    for (int i = 0; i < 2; i++) {
+        disks[i] = disk_open_from_file(argv[i]);
+        if (disks[i] == NULL) {
+            perror(argv[i]);
+            goto done;
+        }
+
+        volumes[i] = fat_open(disks[i], 0);
+        if (volumes[i] == NULL) {
+            perror(argv[i]);
+            goto done;
+        }
+    }
+
+    struct diff_entry_t* entries;
+    size_t entries_n;
+    struct diff_stats_t stats;
+    result = diff_volumes(volumes[0], volumes[1], &entries, &entries_n, &stats);
+    if (result == -1) {
+        perror("diff_volumes");
+        goto done;
+    }
+
+    result = diff_print(stdout, entries, entries_n);
+    fprintf(stderr, "%zu entries compared, %zu clusters compared, %zu clusters skipped\n",
+            stats.entries_compared, stats.clusters_compared, stats.clusters_skipped);
+    diff_free(entries, entries_n);
+
+done:
+    for (int i = 0; i < 2; i++) {
+        if (volumes[i] != NULL) fat_close(volumes[i]);
+        if (disks[i] != NULL) disk_close(disks[i]);
+    }
+
+    return result == 0 ? 0 : 1;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1 && strcmp(argv[1], "scan") == 0) {
+        return scan_command(argc - 2, argv + 2);
+    }
+    if (argc > 1 && strcmp(argv[1], "hash") == 0) {
+        return hash_command(argc - 2, argv + 2);
+    }
+    if (argc > 1 && strcmp(argv[1], "compress") == 0) {
+        return compress_command(argc - 2, argv + 2);
+    }
+    if (argc > 1 && strcmp(argv[1], "fsck") == 0) {
+        return fsck_command(argc - 2, argv + 2);
+    }
+    if (argc > 1 && strcmp(argv[1], "index") == 0) {
+        return index_command(argc - 2, argv + 2);
+    }
+    if (argc > 1 && strcmp(argv[1], "recover") == 0) {
+        return recover_command(argc - 2, argv + 2);
+    }
+    if (argc > 1 && strcmp(argv[1], "search") == 0) {
+        return search_command(argc - 2, argv + 2);
+    }
+    if (argc > 1 && strcmp(argv[1], "diff") == 0) {
+        return diff_command(argc - 2, argv + 2);
+    }
 
-int main() {
     struct disk_t* disk = disk_open_from_file("example-fat16.img");
     if (disk == NULL) {
         perror("disk_open_from_file");
@@ -36,7 +464,7 @@ int main() {
     size_t n = file_read(buf, 1, file->size, file);
     printf("Read %ld bytes\n", n);
 
-    for (int i = 0; i < file->size; i++) {
+    for (uint32_t i = 0; i < file->size; i++) {
         printf("%c", buf[i]);
     }
 
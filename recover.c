@@ -0,0 +1,291 @@
+#include "recover.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct recover_list_t {
+    struct recover_entry_t* entries;
+    size_t entries_n;
+    size_t capacity;
+};
+
+bool is_short_name_char(uint8_t c) {
+    if (c >= 'A' && c <= 'Z') return true;
+    if (c >= '0' && c <= '9') return true;
+    if (c >= 0x80 || c == ' ') return true;
+
+    return strchr("!#$%&'()-@^_`{}~", c) != NULL;
+}
+
+// Strict enough that file data almost never passes: every slot has to be a
+// plausible entry and everything after the end marker has to be zero
+bool looks_like_dir_cluster(struct volume_t* pvolume, const uint8_t* buf, uint32_t len) {
+    uint32_t slots = len / sizeof(struct root_entry_t);
+    bool any = false;
+
+    for (uint32_t i = 0; i < slots; i++) {
+        const struct root_entry_t* entry =
+            (const struct root_entry_t*)(buf + i * sizeof(struct root_entry_t));
+
+        if (entry->name[0] == 0) {
+            for (uint32_t j = i * sizeof(struct root_entry_t); j < len; j++) {
+                if (buf[j] != 0) return false;
+            }
+            return any;
+        }
+
+        // Long file name entries have a different layout
+        if (entry->attributes == 0x0F) {
+            any = true;
+            continue;
+        }
+
+        if (entry->attributes & 0xC0) return false;
+        if (entry->first_cluster == 1 || entry->first_cluster >= pvolume->clusters_n) return false;
+
+        if (entry->name[0] == '.') {
+            if (!((entry->attributes >> 4) & 1)) return false;
+            any = true;
+            continue;
+        }
+
+        for (int j = entry->name[0] == 0xE5 ? 1 : 0; j < 8; j++) {
+            if (!is_short_name_char(entry->name[j])) return false;
+        }
+        for (int j = 0; j < 3; j++) {
+            if (!is_short_name_char(entry->ext[j])) return false;
+        }
+
+        any = true;
+    }
+
+    return any;
+}
+
+void assess(struct volume_t* pvolume, struct recover_entry_t* entry) {
+    uint32_t bytes_per_cluster = pvolume->bytes_per_cluster;
+
+    entry->clusters = ((uint64_t)entry->size + bytes_per_cluster - 1) >> pvolume->cluster_shift;
+    // Directories don't record a size, assume a single cluster
+    if ((entry->attributes >> 4) & 1) entry->clusters = 1;
+
+    entry->free_clusters = 0;
+
+    if (entry->clusters == 0) {
+        entry->state = RECOVER_INTACT;
+        return;
+    }
+
+    if (entry->first_cluster < 2 || entry->first_cluster >= pvolume->clusters_n ||
+        pvolume->fat[entry->first_cluster] != 0) {
+        entry->state = RECOVER_OVERWRITTEN;
+        return;
+    }
+
+    // Deleting a file clears its chain, so the best guess is that it was
+    // stored contiguously
+    for (uint32_t i = 0; i < entry->clusters; i++) {
+        uint32_t cluster = entry->first_cluster + i;
+        if (cluster >= pvolume->clusters_n || pvolume->fat[cluster] != 0) break;
+        entry->free_clusters++;
+    }
+
+    entry->state = entry->free_clusters == entry->clusters ? RECOVER_INTACT : RECOVER_PARTIAL;
+}
+
+int collect_deleted(struct volume_t* pvolume, struct recover_list_t* list, const uint8_t* buf,
+                    uint32_t len, uint16_t dir_cluster) {
+    uint32_t slots = len / sizeof(struct root_entry_t);
+
+    for (uint32_t i = 0; i < slots; i++) {
+        struct root_entry_t entry;
+        memcpy(&entry, buf + i * sizeof(struct root_entry_t), sizeof(struct root_entry_t));
+
+        if (entry.name[0] == 0) break;
+        if (entry.name[0] != 0xE5 || entry.attributes == 0x0F) continue;
+        if ((entry.attributes >> 3) & 1) continue;
+
+        // Names end up in file names on extraction, so only take the same
+        // characters the data area sweep accepts. The root dir isn't swept.
+        bool valid_name = true;
+        for (int j = 1; j < 8 && valid_name; j++) {
+            valid_name = is_short_name_char(entry.name[j]);
+        }
+        for (int j = 0; j < 3 && valid_name; j++) {
+            valid_name = is_short_name_char(entry.ext[j]);
+        }
+        if (!valid_name) continue;
+
+        if (list->entries_n == list->capacity) {
+            size_t new_capacity = list->capacity == 0 ? 64 : list->capacity * 2;
+            struct recover_entry_t* newptr =
+                realloc(list->entries, new_capacity * sizeof(struct recover_entry_t));
+            if (newptr == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+            list->entries = newptr;
+            list->capacity = new_capacity;
+        }
+
+        entry.name[0] = '_';
+        uint8_t* name = clean_file_name(entry.name, entry.ext);
+        if (name == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        struct recover_entry_t* found = &list->entries[list->entries_n++];
+        memset(found, 0, sizeof(struct recover_entry_t));
+        memcpy(found->name, name, strlen((const char*)name) + 1);
+        free(name);
+        found->attributes = entry.attributes;
+        found->first_cluster = entry.first_cluster;
+        found->size = entry.size;
+        found->dir_cluster = dir_cluster;
+
+        assess(pvolume, found);
+    }
+
+    return 0;
+}
+
+// Finds deleted entries in the root dir and in every cluster of the data area
+// that looks like a directory, whether it's still in use or not. The data area
+// is read front to back in RECOVER_READ_SIZE pieces, so the scan runs at
+// sequential read speed and also finds entries of deleted directories.
+int recover_scan(struct volume_t* pvolume, struct recover_entry_t** entries,
+                 size_t* entries_n) {
+    if (pvolume == NULL || entries == NULL || entries_n == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    struct recover_list_t list = {0};
+
+    uint32_t root_dir_size = pvolume->boot_record->root_entries * sizeof(struct root_entry_t);
+    if (collect_deleted(pvolume, &list, pvolume->root_dir, root_dir_size, 0) == -1) {
+        free(list.entries);
+        return -1;
+    }
+
+    uint8_t cluster_shift = pvolume->cluster_shift;
+    uint8_t cluster_sectors_shift = pvolume->cluster_sectors_shift;
+    uint32_t bytes_per_cluster = pvolume->bytes_per_cluster;
+    uint32_t clusters_per_read = RECOVER_READ_SIZE >> cluster_shift;
+    if (clusters_per_read == 0) clusters_per_read = 1;
+
+    uint8_t* buf = malloc((size_t)clusters_per_read << cluster_shift);
+    if (buf == NULL) {
+        free(list.entries);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    // Stop at the end of the disk even if the boot record claims more
+    uint32_t last_cluster = pvolume->clusters_n;
+    uint64_t volume_sectors = pvolume->disk->file_len >> pvolume->sector_shift;
+    if (volume_sectors > pvolume->data_start) {
+        uint64_t disk_clusters =
+            ((volume_sectors - pvolume->data_start) >> cluster_sectors_shift) + 2;
+        if (disk_clusters < last_cluster) last_cluster = disk_clusters;
+    } else {
+        last_cluster = 2;
+    }
+
+    for (uint32_t cluster = 2; cluster < last_cluster; cluster += clusters_per_read) {
+        uint32_t clusters = last_cluster - cluster < clusters_per_read ? last_cluster - cluster
+                                                                       : clusters_per_read;
+        uint32_t sector = cluster_sector(pvolume, cluster);
+
+        if (volume_read(pvolume, sector, buf, clusters << cluster_sectors_shift) == -1) {
+            free(buf);
+            free(list.entries);
+            return -1;
+        }
+
+        for (uint32_t i = 0; i < clusters; i++) {
+            const uint8_t* data = buf + ((size_t)i << cluster_shift);
+
+            // Bad clusters are never part of a directory
+            if (pvolume->fat[cluster + i] == 0xFFF7) continue;
+            if (!looks_like_dir_cluster(pvolume, data, bytes_per_cluster)) continue;
+
+            if (collect_deleted(pvolume, &list, data, bytes_per_cluster, cluster + i) == -1) {
+                free(buf);
+                free(list.entries);
+                return -1;
+            }
+        }
+    }
+
+    free(buf);
+
+    *entries = list.entries;
+    *entries_n = list.entries_n;
+
+    return 0;
+}
+
+// Writes the file's data to `out` assuming it was stored contiguously, which
+// is what `recover_scan` bases its estimate on. Reads as many clusters at once
+// as RECOVER_READ_SIZE allows.
+int recover_extract(struct volume_t* pvolume, struct recover_entry_t* entry, FILE* out) {
+    if (pvolume == NULL || entry == NULL || out == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if (entry->size == 0) return 0;
+
+    uint8_t cluster_shift = pvolume->cluster_shift;
+    uint32_t clusters_left =
+        ((uint64_t)entry->size + pvolume->bytes_per_cluster - 1) >> cluster_shift;
+
+    if (entry->first_cluster < 2 || entry->first_cluster + clusters_left > pvolume->clusters_n) {
+        errno = ERANGE;
+        return -1;
+    }
+
+    uint32_t clusters_per_read = RECOVER_READ_SIZE >> cluster_shift;
+    if (clusters_per_read == 0) clusters_per_read = 1;
+
+    uint8_t* buf = malloc((size_t)clusters_per_read << cluster_shift);
+    if (buf == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    uint32_t cluster = entry->first_cluster;
+    uint32_t bytes_left = entry->size;
+
+    while (clusters_left > 0) {
+        uint32_t clusters = clusters_left < clusters_per_read ? clusters_left : clusters_per_read;
+        uint32_t sector = cluster_sector(pvolume, cluster);
+
+        if (volume_read(pvolume, sector, buf, clusters << pvolume->cluster_sectors_shift) ==
+            -1) {
+            free(buf);
+            return -1;
+        }
+
+        uint32_t n = clusters << cluster_shift;
+        if (n > bytes_left) n = bytes_left;
+
+        if (fwrite(buf, 1, n, out) != n) {
+            free(buf);
+            errno = EIO;
+            return -1;
+        }
+
+        cluster += clusters;
+        clusters_left -= clusters;
+        bytes_left -= n;
+    }
+
+    free(buf);
+
+    return 0;
+}
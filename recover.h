@@ -0,0 +1,41 @@
+#ifndef RECOVER_H
+#define RECOVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "file_reader.h"
+
+// Size of the sequential reads used to sweep the data area
+#define RECOVER_READ_SIZE (4 * 1024 * 1024)
+
+enum recover_state_t {
+    // Every cluster the file needs is still free
+    RECOVER_INTACT,
+    // Some of the clusters after the first one were reused
+    RECOVER_PARTIAL,
+    // The first cluster belongs to another file now
+    RECOVER_OVERWRITTEN,
+};
+
+struct recover_entry_t {
+    // 8.3 name with the deleted first character replaced by '_'
+    char name[13];
+    uint8_t attributes;
+    uint16_t first_cluster;
+    uint32_t size;
+    // Cluster holding the entry, 0 for the root dir
+    uint16_t dir_cluster;
+    enum recover_state_t state;
+    // Clusters the file needs and how many of them, counting contiguously
+    // from the first one, are free
+    uint32_t clusters;
+    uint32_t free_clusters;
+};
+
+int recover_scan(struct volume_t* pvolume, struct recover_entry_t** entries,
+                 size_t* entries_n);
+int recover_extract(struct volume_t* pvolume, struct recover_entry_t* entry, FILE* out);
+
+#endif  // RECOVER_H
@@ -0,0 +1,440 @@
+#include "scan.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// An image stays mounted while any of its directory tasks are queued or running
+struct scan_image_t {
+    const char* name;
+    size_t index;
+    struct disk_t* disk;
+    struct volume_t* volume;
+    // One bit per cluster, set once a directory starting there is queued
+    atomic_uchar* dirs_seen;
+    atomic_size_t refs;
+};
+
+struct scan_task_t {
+    struct scan_image_t* image;
+    // Mount the image and scan its root dir instead of a subdirectory
+    bool is_image;
+    uint16_t first_cluster;
+    char* path;
+};
+
+// Each worker owns a deque. The owner pushes and pops at the bottom, thieves
+// take the oldest tasks from the top, which are usually the biggest subtrees.
+struct scan_deque_t {
+    pthread_mutex_t lock;
+    struct scan_task_t* tasks;
+    size_t top;
+    size_t bottom;
+    size_t capacity;
+};
+
+struct scan_pool_t {
+    struct scan_deque_t* deques;
+    unsigned workers_n;
+    // Tasks that are queued or running, the scan is done when it drops to 0
+    atomic_size_t pending;
+    // Idle workers sleep here until a task is pushed or the scan is done
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    atomic_size_t queued;
+
+    scan_visitor_t visitor;
+    void* arg;
+
+    atomic_size_t images_failed;
+    atomic_size_t dirs;
+    atomic_size_t files;
+    atomic_size_t visitor_errors;
+    atomic_size_t dir_loops;
+    atomic_uint_least64_t bytes;
+};
+
+struct scan_worker_t {
+    struct scan_pool_t* pool;
+    unsigned id;
+};
+
+int deque_push(struct scan_deque_t* deque, struct scan_task_t task) {
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->bottom - deque->top == deque->capacity) {
+        size_t new_capacity = deque->capacity == 0 ? 64 : deque->capacity * 2;
+        struct scan_task_t* newptr = malloc(new_capacity * sizeof(struct scan_task_t));
+        if (newptr == NULL) {
+            pthread_mutex_unlock(&deque->lock);
+            errno = ENOMEM;
+            return -1;
+        }
+
+        for (size_t i = deque->top; i < deque->bottom; i++) {
+            newptr[i - deque->top] = deque->tasks[i % deque->capacity];
+        }
+
+        free(deque->tasks);
+        deque->tasks = newptr;
+        deque->bottom -= deque->top;
+        deque->top = 0;
+        deque->capacity = new_capacity;
+    }
+
+    deque->tasks[deque->bottom % deque->capacity] = task;
+    deque->bottom++;
+
+    pthread_mutex_unlock(&deque->lock);
+
+    return 0;
+}
+
+bool deque_pop(struct scan_deque_t* deque, struct scan_task_t* task) {
+    bool found = false;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom > deque->top) {
+        deque->bottom--;
+        *task = deque->tasks[deque->bottom % deque->capacity];
+        found = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    return found;
+}
+
+bool deque_steal(struct scan_deque_t* deque, struct scan_task_t* task) {
+    bool found = false;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom > deque->top) {
+        *task = deque->tasks[deque->top % deque->capacity];
+        deque->top++;
+        found = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    return found;
+}
+
+void image_release(struct scan_image_t* image) {
+    if (atomic_fetch_sub(&image->refs, 1) != 1) return;
+
+    if (image->volume != NULL) fat_close(image->volume);
+    if (image->disk != NULL) disk_close(image->disk);
+    free(image->dirs_seen);
+}
+
+// Returns false if a directory starting at `cluster` was already queued,
+// which only happens when a corrupt tree links back to an ancestor
+bool claim_dir(struct scan_image_t* image, uint16_t cluster) {
+    if (cluster >= image->volume->clusters_n) return true;
+
+    uint8_t bit = 1 << (cluster & 7);
+    return (atomic_fetch_or(&image->dirs_seen[cluster >> 3], bit) & bit) == 0;
+}
+
+void pool_push(struct scan_pool_t* pool, unsigned worker, struct scan_task_t task) {
+    // Counted before the push so no worker can take the task while the
+    // counters still say there is nothing to do
+    atomic_fetch_add(&pool->pending, 1);
+    atomic_fetch_add(&pool->queued, 1);
+
+    if (deque_push(&pool->deques[worker], task) == -1) {
+        // Out of memory, drop the subtree rather than the whole scan
+        if (task.is_image) atomic_fetch_add(&pool->images_failed, 1);
+        atomic_fetch_sub(&pool->queued, 1);
+        atomic_fetch_sub(&pool->pending, 1);
+        free(task.path);
+        image_release(task.image);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->idle_lock);
+    pthread_cond_signal(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+char* join_path(const char* dir, const char* name) {
+    size_t dir_len = strlen(dir);
+    char* out = malloc(dir_len + strlen(name) + 2);
+    if (out == NULL) {
+        return NULL;
+    }
+
+    memcpy(out, dir, dir_len);
+    out[dir_len] = '\\';
+    strcpy(out + dir_len + 1, name);
+
+    return out;
+}
+
+void scan_entries(struct scan_worker_t* worker, struct scan_task_t* task,
+                  struct root_entry_t** entries, size_t entries_n) {
+    struct scan_pool_t* pool = worker->pool;
+    struct scan_image_t* image = task->image;
+
+    for (size_t i = 0; i < entries_n; i++) {
+        struct root_entry_t* entry = entries[i];
+
+        // Skip volume labels and the "." and ".." entries
+        if ((entry->attributes >> 3) & 1) continue;
+        if (entry->name[0] == '.') continue;
+
+        uint8_t* name = clean_file_name(entry->name, entry->ext);
+        if (name == NULL) continue;
+
+        char* path = join_path(task->path, (char*)name);
+        free(name);
+        if (path == NULL) continue;
+
+        if ((entry->attributes >> 4) & 1) {
+            if (!claim_dir(image, entry->first_cluster)) {
+                atomic_fetch_add(&pool->dir_loops, 1);
+                free(path);
+                continue;
+            }
+
+            // Subdirectories become tasks of their own so idle workers can
+            // steal parts of a big image
+            atomic_fetch_add(&image->refs, 1);
+            struct scan_task_t subtask = {
+                .image = image,
+                .is_image = false,
+                .first_cluster = entry->first_cluster,
+                .path = path,
+            };
+            pool_push(pool, worker->id, subtask);
+            continue;
+        }
+
+        struct file_t* file = file_open_entry(image->volume, entry);
+        if (file == NULL) {
+            atomic_fetch_add(&pool->visitor_errors, 1);
+            free(path);
+            continue;
+        }
+
+        struct scan_file_t scan_file = {
+            .image = image->name,
+            .image_index = image->index,
+            .path = path,
+            .file = file,
+        };
+
+        if (pool->visitor(&scan_file, pool->arg) != 0) {
+            atomic_fetch_add(&pool->visitor_errors, 1);
+        }
+
+        atomic_fetch_add(&pool->files, 1);
+        atomic_fetch_add(&pool->bytes, entry->size);
+
+        file_close(file);
+        free(path);
+    }
+}
+
+void run_task(struct scan_worker_t* worker, struct scan_task_t* task) {
+    struct scan_pool_t* pool = worker->pool;
+    struct scan_image_t* image = task->image;
+
+    if (task->is_image) {
+        image->disk = disk_open_from_file(image->name);
+        if (image->disk != NULL) {
+            image->volume = fat_open(image->disk, 0);
+        }
+        if (image->volume != NULL) {
+            image->dirs_seen = calloc((image->volume->clusters_n + 7) / 8, 1);
+            if (image->dirs_seen == NULL) {
+                fat_close(image->volume);
+                image->volume = NULL;
+            }
+        }
+
+        if (image->volume == NULL) {
+            atomic_fetch_add(&pool->images_failed, 1);
+        } else {
+            scan_entries(worker, task, image->volume->root_entries,
+                         image->volume->root_entries_n);
+        }
+    } else {
+        struct root_entry_t** entries = NULL;
+        size_t entries_n = 0;
+        uint8_t* buf =
+            read_dir_entries(image->volume, task->first_cluster, &entries, &entries_n);
+
+        if (buf != NULL) {
+            atomic_fetch_add(&pool->dirs, 1);
+            scan_entries(worker, task, entries, entries_n);
+            free(entries);
+            free(buf);
+        }
+    }
+
+    free(task->path);
+    image_release(image);
+}
+
+bool find_task(struct scan_worker_t* worker, struct scan_task_t* task) {
+    struct scan_pool_t* pool = worker->pool;
+
+    if (deque_pop(&pool->deques[worker->id], task)) return true;
+
+    // Start stealing from the next worker so thieves spread out
+    for (unsigned i = 1; i < pool->workers_n; i++) {
+        unsigned victim = (worker->id + i) % pool->workers_n;
+        if (deque_steal(&pool->deques[victim], task)) return true;
+    }
+
+    return false;
+}
+
+void* worker_main(void* arg) {
+    struct scan_worker_t* worker = arg;
+    struct scan_pool_t* pool = worker->pool;
+    struct scan_task_t task;
+
+    while (true) {
+        if (find_task(worker, &task)) {
+            atomic_fetch_sub(&pool->queued, 1);
+            run_task(worker, &task);
+
+            if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+                // Last task finished, wake everyone up to exit
+                pthread_mutex_lock(&pool->idle_lock);
+                pthread_cond_broadcast(&pool->idle_cond);
+                pthread_mutex_unlock(&pool->idle_lock);
+            }
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->idle_lock);
+        while (atomic_load(&pool->queued) == 0 && atomic_load(&pool->pending) != 0) {
+            pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+        }
+        bool done = atomic_load(&pool->pending) == 0;
+        pthread_mutex_unlock(&pool->idle_lock);
+
+        if (done) break;
+    }
+
+    return NULL;
+}
+
+int scan_images(const char** images, size_t images_n, unsigned threads,
+                scan_visitor_t visitor, void* arg, struct scan_stats_t* stats) {
+    if (images == NULL || visitor == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (unsigned)cpus : 1;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    struct scan_pool_t pool = {
+        .workers_n = threads,
+        .visitor = visitor,
+        .arg = arg,
+    };
+    pthread_mutex_init(&pool.idle_lock, NULL);
+    pthread_cond_init(&pool.idle_cond, NULL);
+
+    pool.deques = calloc(threads, sizeof(struct scan_deque_t));
+    struct scan_worker_t* workers = calloc(threads, sizeof(struct scan_worker_t));
+    pthread_t* thread_ids = calloc(threads, sizeof(pthread_t));
+    struct scan_image_t* image_states = calloc(images_n > 0 ? images_n : 1,
+                                               sizeof(struct scan_image_t));
+    if (pool.deques == NULL || workers == NULL || thread_ids == NULL ||
+        image_states == NULL) {
+        free(pool.deques);
+        free(workers);
+        free(thread_ids);
+        free(image_states);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (unsigned i = 0; i < threads; i++) {
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+        workers[i].pool = &pool;
+        workers[i].id = i;
+    }
+
+    // Deal images out round-robin, stealing evens out the rest
+    for (size_t i = 0; i < images_n; i++) {
+        struct scan_image_t* image = &image_states[i];
+        image->name = images[i];
+        image->index = i;
+        atomic_init(&image->refs, 1);
+
+        struct scan_task_t task = {
+            .image = image,
+            .is_image = true,
+            .first_cluster = 0,
+            .path = calloc(1, 1),
+        };
+        if (task.path == NULL) {
+            atomic_fetch_add(&pool.images_failed, 1);
+            continue;
+        }
+
+        pool_push(&pool, i % threads, task);
+    }
+
+    unsigned started = 0;
+    for (; started < threads; started++) {
+        if (pthread_create(&thread_ids[started], NULL, worker_main, &workers[started]) != 0) {
+            break;
+        }
+    }
+
+    // Run inline if no thread could be started
+    if (started == 0) {
+        worker_main(&workers[0]);
+    }
+
+    for (unsigned i = 0; i < started; i++) {
+        pthread_join(thread_ids[i], NULL);
+    }
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (stats != NULL) {
+        stats->images = images_n;
+        stats->images_failed = atomic_load(&pool.images_failed);
+        stats->dirs = atomic_load(&pool.dirs);
+        stats->files = atomic_load(&pool.files);
+        stats->visitor_errors = atomic_load(&pool.visitor_errors);
+        stats->dir_loops = atomic_load(&pool.dir_loops);
+        stats->bytes = atomic_load(&pool.bytes);
+        stats->seconds =
+            (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    }
+
+    for (unsigned i = 0; i < threads; i++) {
+        pthread_mutex_destroy(&pool.deques[i].lock);
+        free(pool.deques[i].tasks);
+    }
+    pthread_mutex_destroy(&pool.idle_lock);
+    pthread_cond_destroy(&pool.idle_cond);
+
+    free(pool.deques);
+    free(workers);
+    free(thread_ids);
+    free(image_states);
+
+    return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "file_reader.h"
+
+// File passed to a scan visitor. `file` is open for reading and is closed by
+// the scan engine once the visitor returns.
+struct scan_file_t {
+    const char* image;
+    size_t image_index;
+    // Full path inside the image, e.g. "\DIR\FILE.TXT"
+    const char* path;
+    struct file_t* file;
+};
+
+// Called concurrently from all worker threads, so it must be thread-safe.
+// A non-zero return value is counted in `scan_stats_t.visitor_errors`.
+typedef int (*scan_visitor_t)(const struct scan_file_t* file, void* arg);
+
+struct scan_stats_t {
+    size_t images;
+    size_t images_failed;
+    size_t dirs;
+    size_t files;
+    size_t visitor_errors;
+    // Directories skipped because a corrupt tree led back to them
+    size_t dir_loops;
+    // Sum of the sizes of all visited files
+    uint64_t bytes;
+    double seconds;
+};
+
+int scan_images(const char** images, size_t images_n, unsigned threads,
+                scan_visitor_t visitor, void* arg, struct scan_stats_t* stats);
+
+#endif  // SCAN_H
@@ -0,0 +1,390 @@
+#include "search.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SEARCH_X86
+#endif
+
+#include "volume_files.h"
+
+struct search_hit_t {
+    uint32_t offset;
+    size_t pattern;
+};
+
+// Results for one file, in the same slot as the file in `files`
+struct search_file_t {
+    struct search_hit_t* hits;
+    size_t hits_n;
+    size_t hits_capacity;
+    int error;
+};
+
+struct search_job_t {
+    struct volume_t* volume;
+    const struct search_pattern_t* patterns;
+    size_t patterns_n;
+    size_t max_length;
+    struct volume_file_t* files;
+    struct search_file_t* results;
+};
+
+typedef int (*search_scan_t)(const uint8_t* buf, size_t len, size_t from,
+                             const struct search_pattern_t* pattern, size_t pattern_i,
+                             uint32_t base, struct search_file_t* file);
+
+static search_scan_t search_scan;
+static pthread_once_t search_once = PTHREAD_ONCE_INIT;
+
+int add_hit(struct search_file_t* file, uint32_t offset, size_t pattern) {
+    if (file->hits_n == file->hits_capacity) {
+        size_t new_capacity = file->hits_capacity == 0 ? 16 : file->hits_capacity * 2;
+
+        struct search_hit_t* new_hits =
+            realloc(file->hits, new_capacity * sizeof(struct search_hit_t));
+        if (new_hits == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        file->hits = new_hits;
+        file->hits_capacity = new_capacity;
+    }
+
+    file->hits[file->hits_n].offset = offset;
+    file->hits[file->hits_n].pattern = pattern;
+    file->hits_n++;
+
+    return 0;
+}
+
+// Reports every start position in [from, len) where the pattern fits
+// completely in `buf`
+int scan_scalar(const uint8_t* buf, size_t len, size_t from,
+                const struct search_pattern_t* pattern, size_t pattern_i, uint32_t base,
+                struct search_file_t* file) {
+    if (len < pattern->length) return 0;
+
+    const uint8_t* p = buf + from;
+    const uint8_t* last = buf + len - pattern->length;
+
+    while (p <= last) {
+        p = memchr(p, pattern->data[0], last - p + 1);
+        if (p == NULL) break;
+
+        if (memcmp(p, pattern->data, pattern->length) == 0 &&
+            add_hit(file, base + (uint32_t)(p - buf), pattern_i) == -1) {
+            return -1;
+        }
+        p++;
+    }
+
+    return 0;
+}
+
+#ifdef SEARCH_X86
+// Candidates are positions where both the first and the last byte of the
+// pattern match, only those get compared in full
+#ifdef __SSE2__
+int scan_sse2(const uint8_t* buf, size_t len, size_t from, const struct search_pattern_t* pattern,
+              size_t pattern_i, uint32_t base, struct search_file_t* file) {
+    size_t length = pattern->length;
+    if (len < length) return 0;
+
+    const __m128i first = _mm_set1_epi8((char)pattern->data[0]);
+    const __m128i last = _mm_set1_epi8((char)pattern->data[length - 1]);
+
+    size_t i = from;
+    for (; i + length - 1 + 16 <= len; i += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i*)(buf + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i*)(buf + i + length - 1));
+
+        unsigned mask = (unsigned)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(first, block_first), _mm_cmpeq_epi8(last, block_last)));
+
+        while (mask != 0) {
+            size_t pos = i + __builtin_ctz(mask);
+            if (memcmp(buf + pos, pattern->data, length) == 0 &&
+                add_hit(file, base + (uint32_t)pos, pattern_i) == -1) {
+                return -1;
+            }
+            mask &= mask - 1;
+        }
+    }
+
+    return scan_scalar(buf, len, i, pattern, pattern_i, base, file);
+}
+#endif
+
+__attribute__((target("avx2"))) int scan_avx2(const uint8_t* buf, size_t len, size_t from,
+                                              const struct search_pattern_t* pattern,
+                                              size_t pattern_i, uint32_t base,
+                                              struct search_file_t* file) {
+    size_t length = pattern->length;
+    if (len < length) return 0;
+
+    const __m256i first = _mm256_set1_epi8((char)pattern->data[0]);
+    const __m256i last = _mm256_set1_epi8((char)pattern->data[length - 1]);
+
+    size_t i = from;
+    for (; i + length - 1 + 32 <= len; i += 32) {
+        __m256i block_first = _mm256_loadu_si256((const __m256i*)(buf + i));
+        __m256i block_last = _mm256_loadu_si256((const __m256i*)(buf + i + length - 1));
+
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(
+            _mm256_cmpeq_epi8(first, block_first), _mm256_cmpeq_epi8(last, block_last)));
+
+        while (mask != 0) {
+            size_t pos = i + __builtin_ctz(mask);
+            if (memcmp(buf + pos, pattern->data, length) == 0 &&
+                add_hit(file, base + (uint32_t)pos, pattern_i) == -1) {
+                return -1;
+            }
+            mask &= mask - 1;
+        }
+    }
+
+    return scan_scalar(buf, len, i, pattern, pattern_i, base, file);
+}
+#endif
+
+void search_init_once(void) {
+    search_scan = scan_scalar;
+
+#ifdef SEARCH_X86
+#ifdef __SSE2__
+    search_scan = scan_sse2;
+#endif
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) search_scan = scan_avx2;
+#endif
+}
+
+int compare_hits(const void* a, const void* b) {
+    const struct search_hit_t* left = a;
+    const struct search_hit_t* right = b;
+
+    if (left->offset != right->offset) return left->offset < right->offset ? -1 : 1;
+    if (left->pattern != right->pattern) return left->pattern < right->pattern ? -1 : 1;
+    return 0;
+}
+
+// `buf` holds the last max_length - 1 bytes of the previous chunk followed by
+// up to SEARCH_CHUNK_SIZE new bytes. Only matches ending in the new bytes are
+// reported, the others were already found in the previous chunk.
+int search_file(struct search_job_t* job, struct root_entry_t* entry,
+                struct search_file_t* file, uint8_t* buf) {
+    struct volume_t* pvolume = job->volume;
+
+    struct file_t* handle = file_open_entry(pvolume, entry);
+    if (handle == NULL) {
+        return -1;
+    }
+
+    struct extent_t* extents = NULL;
+    size_t extents_n = 0;
+    if (file_extents(handle, &extents, &extents_n) == -1) {
+        file_close(handle);
+        return -1;
+    }
+
+    size_t extent = 0;
+    uint32_t sector = extents_n > 0 ? extents[0].sector : 0;
+    uint32_t sectors_left = extents_n > 0 ? extents[0].sectors : 0;
+
+    uint32_t bytes_left = entry->size;
+    uint32_t base = 0;
+    size_t carry = 0;
+    int result = 0;
+
+    while (bytes_left > 0 && extent < extents_n) {
+        size_t fill = carry;
+
+        // Fill the chunk across as many extents as it takes
+        while (bytes_left > 0 && extent < extents_n) {
+            uint32_t room = (carry + SEARCH_CHUNK_SIZE - fill) >> pvolume->sector_shift;
+            if (room == 0) break;
+
+            uint32_t sectors = sectors_left < room ? sectors_left : room;
+            if (volume_read(pvolume, sector, buf + fill, sectors) == -1) {
+                result = -1;
+                break;
+            }
+
+            uint32_t n = sectors << pvolume->sector_shift;
+            if (n > bytes_left) n = bytes_left;
+
+            fill += n;
+            bytes_left -= n;
+            sector += sectors;
+            sectors_left -= sectors;
+
+            if (sectors_left == 0 && ++extent < extents_n) {
+                sector = extents[extent].sector;
+                sectors_left = extents[extent].sectors;
+            }
+        }
+
+        if (result == -1) break;
+
+        for (size_t i = 0; i < job->patterns_n; i++) {
+            size_t length = job->patterns[i].length;
+            size_t from = carry >= length ? carry - length + 1 : 0;
+
+            if (search_scan(buf, fill, from, &job->patterns[i], i, base, file) == -1) {
+                result = -1;
+                break;
+            }
+        }
+
+        if (result == -1) break;
+
+        size_t keep = job->max_length - 1;
+        if (keep > fill) keep = fill;
+        memmove(buf, buf + fill - keep, keep);
+        base += fill - keep;
+        carry = keep;
+    }
+
+    // A chain shorter than the size in the entry can't be searched completely
+    if (result == 0 && bytes_left > 0) {
+        errno = EIO;
+        result = -1;
+    }
+
+    if (result == 0 && file->hits_n > 1) {
+        qsort(file->hits, file->hits_n, sizeof(struct search_hit_t), compare_hits);
+    }
+
+    free(extents);
+    file_close(handle);
+
+    return result;
+}
+
+void search_worker(size_t index, uint8_t* buf, void* arg) {
+    struct search_job_t* job = arg;
+
+    if (search_file(job, &job->files[index].entry, &job->results[index], buf) == -1) {
+        job->results[index].error = errno;
+    }
+}
+
+void free_search_job(struct search_job_t* job, size_t files_n) {
+    for (size_t i = 0; i < files_n; i++) {
+        free(job->results[i].hits);
+    }
+    free(job->results);
+    volume_files_free(job->files, files_n);
+}
+
+// Looks for every pattern in every file on the volume. Matches are ordered
+// by file in directory walk order, then by offset and pattern, and must be
+// freed with `search_free`. Files that couldn't be read get a single record
+// with `error` set.
+int search_volume(struct volume_t* pvolume, const struct search_pattern_t* patterns,
+                  size_t patterns_n, unsigned threads, struct search_match_t** matches,
+                  size_t* matches_n) {
+    if (pvolume == NULL || patterns == NULL || matches == NULL || matches_n == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if (patterns_n == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct search_job_t job = {
+        .volume = pvolume,
+        .patterns = patterns,
+        .patterns_n = patterns_n,
+    };
+
+    for (size_t i = 0; i < patterns_n; i++) {
+        if (patterns[i].data == NULL || patterns[i].length == 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (patterns[i].length > job.max_length) job.max_length = patterns[i].length;
+    }
+
+    pthread_once(&search_once, search_init_once);
+
+    size_t files_n;
+    if (volume_files_collect(pvolume, &job.files, &files_n) == -1) {
+        return -1;
+    }
+
+    job.results = calloc(files_n > 0 ? files_n : 1, sizeof(struct search_file_t));
+    if (job.results == NULL) {
+        volume_files_free(job.files, files_n);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (volume_files_run(files_n, threads, job.max_length - 1 + SEARCH_CHUNK_SIZE,
+                         search_worker, &job) == -1) {
+        free_search_job(&job, files_n);
+        return -1;
+    }
+
+    size_t total = 0;
+    for (size_t i = 0; i < files_n; i++) {
+        total += job.results[i].error != 0 ? 1 : job.results[i].hits_n;
+    }
+
+    struct search_match_t* out = calloc(total > 0 ? total : 1, sizeof(struct search_match_t));
+    if (out == NULL) {
+        free_search_job(&job, files_n);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < files_n; i++) {
+        struct search_file_t* file = &job.results[i];
+        size_t records = file->error != 0 ? 1 : file->hits_n;
+
+        for (size_t j = 0; j < records; j++) {
+            struct search_match_t* match = &out[n];
+
+            match->path = strdup(job.files[i].path);
+            if (match->path == NULL) {
+                search_free(out, n);
+                free_search_job(&job, files_n);
+                errno = ENOMEM;
+                return -1;
+            }
+            n++;
+
+            if (file->error != 0) {
+                match->error = file->error;
+            } else {
+                match->offset = file->hits[j].offset;
+                match->pattern = file->hits[j].pattern;
+            }
+        }
+    }
+
+    free_search_job(&job, files_n);
+
+    *matches = out;
+    *matches_n = n;
+
+    return 0;
+}
+
+void search_free(struct search_match_t* matches, size_t matches_n) {
+    if (matches == NULL) return;
+
+    for (size_t i = 0; i < matches_n; i++) {
+        free(matches[i].path);
+    }
+    free(matches);
+}
@@ -0,0 +1,34 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "file_reader.h"
+
+// Files are streamed through the matcher in chunks of this size, the tail of
+// each chunk is carried over so matches across chunk and extent boundaries
+// are still found
+#define SEARCH_CHUNK_SIZE (256 * 1024)
+
+struct search_pattern_t {
+    const uint8_t* data;
+    size_t length;
+};
+
+struct search_match_t {
+    char* path;
+    // Byte offset of the match within the file
+    uint32_t offset;
+    // Index of the pattern that matched
+    size_t pattern;
+    // 0 for a match, otherwise the errno value for a file that couldn't be read
+    int error;
+};
+
+int search_volume(struct volume_t* pvolume, const struct search_pattern_t* patterns,
+                  size_t patterns_n, unsigned threads, struct search_match_t** matches,
+                  size_t* matches_n);
+void search_free(struct search_match_t* matches, size_t matches_n);
+
+#endif  // SEARCH_H
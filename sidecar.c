@@ -0,0 +1,608 @@
+#include "sidecar.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hash.h"
+
+// The index stays valid as long as the image file itself is untouched. Its
+// inode, size and modification time catch edits to subdirectory clusters,
+// which the boot record, FAT and root dir alone would miss.
+int sidecar_key(struct volume_t* pvolume, uint8_t* key) {
+    struct boot_record_t* boot_record = pvolume->boot_record;
+    struct sha256_t sha;
+
+    struct stat st;
+    if (fstat(fileno(pvolume->disk->fd), &st) == -1) {
+        return -1;
+    }
+
+    uint64_t identity[5] = {
+        (uint64_t)st.st_dev,
+        (uint64_t)st.st_ino,
+        (uint64_t)st.st_size,
+        (uint64_t)st.st_mtim.tv_sec,
+        (uint64_t)st.st_mtim.tv_nsec,
+    };
+
+    sha256_init(&sha);
+    sha256_update(&sha, identity, sizeof(identity));
+    sha256_update(&sha, boot_record, sizeof(struct boot_record_t));
+    sha256_update(&sha, pvolume->fat,
+                  (size_t)boot_record->sectors_per_fat << pvolume->sector_shift);
+    sha256_update(&sha, pvolume->root_dir,
+                  (size_t)boot_record->root_entries * sizeof(struct root_entry_t));
+    sha256_final(&sha, key);
+
+    return 0;
+}
+
+size_t align_up(size_t offset, size_t align) {
+    return (offset + align - 1) / align * align;
+}
+
+// The name order follows the nodes, the extents follow the name order, each
+// at the next offset it can be read from aligned
+size_t sidecar_order_offset(uint32_t nodes_n) {
+    return align_up(
+        sizeof(struct sidecar_header_t) + (size_t)nodes_n * sizeof(struct sidecar_node_t),
+        _Alignof(uint32_t));
+}
+
+size_t sidecar_extents_offset(uint32_t nodes_n) {
+    return align_up(sidecar_order_offset(nodes_n) + (size_t)nodes_n * sizeof(uint32_t),
+                    _Alignof(struct extent_t));
+}
+
+struct sidecar_builder_t {
+    struct sidecar_node_t* nodes;
+    size_t nodes_n;
+    size_t nodes_capacity;
+    struct extent_t* extents;
+    size_t extents_n;
+    size_t extents_capacity;
+};
+
+// Orders pointers to nodes by name, equal names by position so a lookup
+// finds the first of them like a directory scan would
+int compare_nodes(const void* a, const void* b) {
+    const struct sidecar_node_t* x = *(const struct sidecar_node_t* const*)a;
+    const struct sidecar_node_t* y = *(const struct sidecar_node_t* const*)b;
+
+    int order = memcmp(x->name, y->name, 11);
+    if (order != 0) return order;
+
+    return x < y ? -1 : x > y;
+}
+
+int add_node(struct sidecar_builder_t* builder, struct root_entry_t* entry, uint32_t parent) {
+    if (builder->nodes_n == builder->nodes_capacity) {
+        size_t new_capacity = builder->nodes_capacity == 0 ? 64 : builder->nodes_capacity * 2;
+        struct sidecar_node_t* newptr =
+            realloc(builder->nodes, new_capacity * sizeof(struct sidecar_node_t));
+        if (newptr == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        builder->nodes = newptr;
+        builder->nodes_capacity = new_capacity;
+    }
+
+    struct sidecar_node_t* node = &builder->nodes[builder->nodes_n++];
+    memset(node, 0, sizeof(struct sidecar_node_t));
+    memcpy(node->name, entry->name, 8);
+    memcpy(node->name + 8, entry->ext, 3);
+    node->attributes = entry->attributes;
+    node->size = entry->size;
+    node->first_cluster = entry->first_cluster;
+    node->parent = parent;
+
+    return 0;
+}
+
+int add_extents(struct sidecar_builder_t* builder, struct volume_t* pvolume,
+                struct sidecar_node_t* node) {
+    node->first_extent = builder->extents_n;
+
+    if (node->first_cluster == 0 || node->size == 0) return 0;
+
+    struct root_entry_t entry = {
+        .attributes = node->attributes,
+        .first_cluster = node->first_cluster,
+        .size = node->size,
+    };
+    memcpy(entry.name, node->name, 8);
+    memcpy(entry.ext, node->name + 8, 3);
+    struct file_t* file = file_open_entry(pvolume, &entry);
+    if (file == NULL) {
+        return -1;
+    }
+
+    struct extent_t* extents;
+    size_t extents_n;
+    int result = file_extents(file, &extents, &extents_n);
+    file_close(file);
+    if (result == -1) {
+        return -1;
+    }
+
+    if (builder->extents_n + extents_n > builder->extents_capacity) {
+        size_t new_capacity = builder->extents_capacity == 0 ? 64 : builder->extents_capacity;
+        while (new_capacity < builder->extents_n + extents_n) new_capacity *= 2;
+
+        struct extent_t* newptr = realloc(builder->extents, new_capacity * sizeof(struct extent_t));
+        if (newptr == NULL) {
+            free(extents);
+            errno = ENOMEM;
+            return -1;
+        }
+        builder->extents = newptr;
+        builder->extents_capacity = new_capacity;
+    }
+
+    memcpy(builder->extents + builder->extents_n, extents, extents_n * sizeof(struct extent_t));
+    builder->extents_n += extents_n;
+    node->extents_n = extents_n;
+    free(extents);
+
+    return 0;
+}
+
+// Walks the whole tree breadth-first from the disk, ignoring any loaded sidecar
+int build_tree(struct sidecar_builder_t* builder, struct volume_t* pvolume) {
+    struct root_entry_t root = {.attributes = ATTR_DIRECTORY};
+    memset(root.name, ' ', 8);
+    memset(root.ext, ' ', 3);
+    if (add_node(builder, &root, 0) == -1) {
+        return -1;
+    }
+
+    // Directories already expanded, a corrupt tree that loops can't be indexed
+    bool* seen = calloc(pvolume->clusters_n > 0 ? pvolume->clusters_n : 1, sizeof(bool));
+    if (seen == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    int result = 0;
+
+    for (size_t i = 0; i < builder->nodes_n && result == 0; i++) {
+        struct sidecar_node_t* node = &builder->nodes[i];
+
+        if (!((node->attributes >> 4) & 1)) {
+            result = add_extents(builder, pvolume, node);
+            continue;
+        }
+
+        struct root_entry_t** entries = pvolume->root_entries;
+        size_t entries_n = pvolume->root_entries_n;
+        uint8_t* buf = NULL;
+
+        if (i != 0) {
+            if (node->first_cluster < 2 || node->first_cluster >= pvolume->clusters_n) {
+                continue;
+            }
+            if (seen[node->first_cluster]) {
+                errno = EIO;
+                result = -1;
+                break;
+            }
+            seen[node->first_cluster] = true;
+
+            buf = read_dir_entries(pvolume, node->first_cluster, &entries, &entries_n);
+            if (buf == NULL) {
+                result = -1;
+                break;
+            }
+        }
+
+        size_t first_child = builder->nodes_n;
+
+        for (size_t j = 0; j < entries_n && result == 0; j++) {
+            // Skip volume labels and the "." and ".." entries
+            if ((entries[j]->attributes >> 3) & 1) continue;
+            if (entries[j]->name[0] == '.') continue;
+
+            result = add_node(builder, entries[j], i);
+        }
+
+        if (buf != NULL) {
+            free(entries);
+            free(buf);
+        }
+
+        // add_node may have moved the array
+        node = &builder->nodes[i];
+        node->first_child = first_child;
+        node->children_n = builder->nodes_n - first_child;
+    }
+
+    free(seen);
+
+    return result;
+}
+
+// Children stay in directory order so listings match the disk. Lookups go
+// through `order`, which holds the indices of each node's children sorted by
+// name in the same slots the children occupy.
+uint32_t* build_order(struct sidecar_builder_t* builder) {
+    uint32_t* order = malloc((builder->nodes_n > 0 ? builder->nodes_n : 1) * sizeof(uint32_t));
+    struct sidecar_node_t** sorted =
+        malloc((builder->nodes_n > 0 ? builder->nodes_n : 1) * sizeof(struct sidecar_node_t*));
+    if (order == NULL || sorted == NULL) {
+        free(order);
+        free(sorted);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    for (size_t i = 0; i < builder->nodes_n; i++) {
+        sorted[i] = &builder->nodes[i];
+    }
+
+    // The root dir has no parent and keeps its own slot
+    order[0] = 0;
+    for (size_t i = 0; i < builder->nodes_n; i++) {
+        struct sidecar_node_t* node = &builder->nodes[i];
+        if (node->children_n == 0) continue;
+
+        qsort(sorted + node->first_child, node->children_n, sizeof(struct sidecar_node_t*),
+              compare_nodes);
+        for (uint32_t j = node->first_child; j < node->first_child + node->children_n; j++) {
+            order[j] = sorted[j] - builder->nodes;
+        }
+    }
+
+    free(sorted);
+
+    return order;
+}
+
+int sidecar_build(struct volume_t* pvolume, const char* sidecar_file_name) {
+    if (pvolume == NULL || sidecar_file_name == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    struct sidecar_builder_t builder = {0};
+    if (build_tree(&builder, pvolume) == -1) {
+        free(builder.nodes);
+        free(builder.extents);
+        return -1;
+    }
+
+    struct sidecar_header_t header;
+    memcpy(header.magic, SIDECAR_MAGIC, sizeof(header.magic));
+    uint32_t* order = NULL;
+    if (sidecar_key(pvolume, header.key) == -1 || (order = build_order(&builder)) == NULL) {
+        free(builder.nodes);
+        free(builder.extents);
+        return -1;
+    }
+    header.nodes_n = builder.nodes_n;
+    header.extents_n = builder.extents_n;
+
+    static const uint8_t padding[sizeof(struct extent_t)];
+    size_t order_offset = sidecar_order_offset(header.nodes_n);
+    size_t order_padding_n =
+        order_offset - sizeof(header) - builder.nodes_n * sizeof(struct sidecar_node_t);
+    size_t extents_padding_n = sidecar_extents_offset(header.nodes_n) - order_offset -
+                               builder.nodes_n * sizeof(uint32_t);
+
+    // Written next to the final name and renamed so a reader never maps a
+    // half written index
+    size_t tmp_len = strlen(sidecar_file_name) + 5;
+    char tmp_name[tmp_len];
+    snprintf(tmp_name, tmp_len, "%s.tmp", sidecar_file_name);
+
+    FILE* out = fopen(tmp_name, "w");
+    if (out == NULL) {
+        free(builder.nodes);
+        free(builder.extents);
+        free(order);
+        return -1;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+              fwrite(builder.nodes, sizeof(struct sidecar_node_t), builder.nodes_n, out) ==
+                  builder.nodes_n &&
+              fwrite(padding, 1, order_padding_n, out) == order_padding_n &&
+              fwrite(order, sizeof(uint32_t), builder.nodes_n, out) == builder.nodes_n &&
+              fwrite(padding, 1, extents_padding_n, out) == extents_padding_n &&
+              fwrite(builder.extents, sizeof(struct extent_t), builder.extents_n, out) ==
+                  builder.extents_n;
+
+    free(builder.nodes);
+    free(builder.extents);
+    free(order);
+
+    if (fclose(out) != 0 || !ok || rename(tmp_name, sidecar_file_name) != 0) {
+        unlink(tmp_name);
+        errno = EIO;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Maps a sidecar if it exists and matches the volume. Returns NULL if it's
+// missing, stale or malformed, in which case the volume is read as usual.
+struct sidecar_t* sidecar_open(struct volume_t* pvolume, const char* sidecar_file_name) {
+    if (pvolume == NULL || sidecar_file_name == NULL) {
+        errno = EFAULT;
+        return NULL;
+    }
+
+    int fd = open(sidecar_file_name, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct sidecar_header_t)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    struct sidecar_header_t* header = map;
+    uint8_t key[32];
+    if (sidecar_key(pvolume, key) == -1) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    size_t expected_size = sidecar_extents_offset(header->nodes_n) +
+                           (size_t)header->extents_n * sizeof(struct extent_t);
+
+    if (memcmp(header->magic, SIDECAR_MAGIC, sizeof(header->magic)) != 0 ||
+        memcmp(header->key, key, sizeof(key)) != 0 || header->nodes_n == 0 ||
+        expected_size != (size_t)st.st_size) {
+        munmap(map, st.st_size);
+        errno = ESTALE;
+        return NULL;
+    }
+
+    struct sidecar_node_t* nodes = (struct sidecar_node_t*)(header + 1);
+    uint32_t* order = (uint32_t*)((uint8_t*)map + sidecar_order_offset(header->nodes_n));
+
+    // Children must come after their parent, which rules out cycles
+    for (uint32_t i = 0; i < header->nodes_n; i++) {
+        struct sidecar_node_t* node = &nodes[i];
+        bool valid = node->parent < header->nodes_n &&
+                     (node->children_n == 0 ||
+                      (node->first_child > i && node->first_child <= header->nodes_n &&
+                       node->children_n <= header->nodes_n - node->first_child)) &&
+                     node->first_extent <= header->extents_n &&
+                     node->extents_n <= header->extents_n - node->first_extent;
+
+        // The name order of a node's children may only point at those children
+        for (uint32_t j = 0; j < node->children_n && valid; j++) {
+            uint32_t child = order[node->first_child + j];
+            valid = child >= node->first_child && child - node->first_child < node->children_n;
+        }
+
+        if (!valid) {
+            munmap(map, st.st_size);
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+
+    struct sidecar_t* sidecar = malloc(sizeof(struct sidecar_t));
+    if (sidecar == NULL) {
+        munmap(map, st.st_size);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    sidecar->map = map;
+    sidecar->map_size = st.st_size;
+    sidecar->header = header;
+    sidecar->nodes = nodes;
+    sidecar->order = order;
+    sidecar->extents =
+        (struct extent_t*)((uint8_t*)map + sidecar_extents_offset(header->nodes_n));
+
+    return sidecar;
+}
+
+int sidecar_close(struct sidecar_t* sidecar) {
+    if (sidecar == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    munmap(sidecar->map, sidecar->map_size);
+    free(sidecar);
+
+    return 0;
+}
+
+// Resolves an upper case path to a node index, 0 being the root dir
+int32_t sidecar_lookup(struct sidecar_t* sidecar, const char* path) {
+    if (sidecar == NULL || path == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    char* copy = strdup(path);
+    if (copy == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    uint32_t current = 0;
+    char* rest = copy;
+    char* part;
+
+    while ((part = strsep(&rest, "\\")) != NULL) {
+        if (strlen(part) == 0 || strcmp(part, ".") == 0) continue;
+
+        if (strcmp(part, "..") == 0) {
+            current = sidecar->nodes[current].parent;
+            continue;
+        }
+
+        struct sidecar_node_t* node = &sidecar->nodes[current];
+        struct sidecar_node_t key;
+
+        if (!((node->attributes >> 4) & 1) || !make_short_name(part, key.name)) {
+            free(copy);
+            errno = ENOENT;
+            return -1;
+        }
+
+        // Lower bound, so the first of several equal names is found
+        uint32_t* children = sidecar->order + node->first_child;
+        uint32_t low = 0;
+        uint32_t high = node->children_n;
+        while (low < high) {
+            uint32_t mid = low + (high - low) / 2;
+            if (memcmp(sidecar->nodes[children[mid]].name, key.name, 11) < 0) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+
+        if (low == node->children_n ||
+            memcmp(sidecar->nodes[children[low]].name, key.name, 11) != 0) {
+            free(copy);
+            errno = ENOENT;
+            return -1;
+        }
+
+        current = children[low];
+    }
+
+    free(copy);
+
+    return current;
+}
+
+void sidecar_entry(struct sidecar_t* sidecar, uint32_t node, struct root_entry_t* entry) {
+    struct sidecar_node_t* n = &sidecar->nodes[node];
+
+    memset(entry, 0, sizeof(struct root_entry_t));
+    memcpy(entry->name, n->name, 8);
+    memcpy(entry->ext, n->name + 8, 3);
+    entry->attributes = n->attributes;
+    entry->size = n->size;
+    entry->first_cluster = n->first_cluster;
+}
+
+// Same entries as reading the directory's clusters in dir_open, in the same
+// order after "." and "..". Each entry and the array have to be freed.
+int sidecar_list(struct sidecar_t* sidecar, const char* path, struct root_entry_t*** entries,
+                 uint16_t* entries_n) {
+    int32_t node = sidecar_lookup(sidecar, path);
+    if (node == -1) {
+        return -1;
+    }
+
+    struct sidecar_node_t* dir = &sidecar->nodes[node];
+    if (!((dir->attributes >> 4) & 1) || ((dir->attributes >> 3) & 1)) {
+        errno = ENOTDIR;
+        return -1;
+    }
+
+    // The root dir has no "." and ".." entries
+    uint32_t dots_n = node == 0 ? 0 : 2;
+    uint32_t total = dots_n + dir->children_n;
+
+    // dir_t counts entries in 16 bits
+    if (total > UINT16_MAX) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+
+    *entries = malloc((total > 0 ? total : 1) * sizeof(struct root_entry_t*));
+    if (*entries == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < total; i++) {
+        struct root_entry_t* entry = malloc(sizeof(struct root_entry_t));
+        if (entry == NULL) {
+            for (uint32_t j = 0; j < i; j++) free((*entries)[j]);
+            free(*entries);
+            errno = ENOMEM;
+            return -1;
+        }
+
+        if (i < dots_n) {
+            // ".." has first_cluster 0 when the parent is the root dir
+            uint32_t target = i == 0 ? (uint32_t)node : dir->parent;
+            sidecar_entry(sidecar, target, entry);
+            memset(entry->name, ' ', 8);
+            memset(entry->ext, ' ', 3);
+            memset(entry->name, '.', i + 1);
+        } else {
+            sidecar_entry(sidecar, dir->first_child + i - dots_n, entry);
+        }
+
+        (*entries)[i] = entry;
+    }
+
+    *entries_n = total;
+
+    return 0;
+}
+
+int walk_node(struct sidecar_t* sidecar, uint32_t node, const char* dir_path,
+              walk_callback_t callback, void* arg) {
+    struct sidecar_node_t* dir = &sidecar->nodes[node];
+    size_t dir_path_len = strlen(dir_path);
+
+    for (uint32_t i = 0; i < dir->children_n; i++) {
+        uint32_t child = dir->first_child + i;
+        struct root_entry_t entry;
+        sidecar_entry(sidecar, child, &entry);
+
+        uint8_t* name = clean_file_name(entry.name, entry.ext);
+        if (name == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        char path[dir_path_len + 14];
+        memcpy(path, dir_path, dir_path_len);
+        path[dir_path_len] = '\\';
+        strcpy(path + dir_path_len + 1, (char*)name);
+        free(name);
+
+        int result = callback(path, &entry, arg);
+        if (result != 0) return result;
+
+        if ((entry.attributes >> 4) & 1) {
+            result = walk_node(sidecar, child, path, callback, arg);
+            if (result != 0) return result;
+        }
+    }
+
+    return 0;
+}
+
+// Same traversal as volume_walk without any directory I/O
+int sidecar_walk(struct sidecar_t* sidecar, walk_callback_t callback, void* arg) {
+    if (sidecar == NULL || callback == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    return walk_node(sidecar, 0, "", callback, arg);
+}
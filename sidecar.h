@@ -0,0 +1,60 @@
+#ifndef SIDECAR_H
+#define SIDECAR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "file_reader.h"
+
+// Sidecars live next to the image as "<image>.idx"
+#define SIDECAR_SUFFIX ".idx"
+#define SIDECAR_MAGIC "FAT16IX3"
+
+// File layout: header, nodes, the name order, extents, with padding so the
+// order and the extents start aligned. Everything is addressed by index so
+// the file can be mapped and used read-only as is.
+struct sidecar_header_t {
+    uint8_t magic[8];
+    // SHA-256 of the image file's identity and mtime, and of the boot record,
+    // FAT and root directory the index was built from
+    uint8_t key[32];
+    uint32_t nodes_n;
+    uint32_t extents_n;
+} __attribute__((packed));
+
+// Node 0 is the root directory. Nodes are stored breadth-first, so children
+// of a directory are contiguous, in directory order and always after their
+// parent. The name order holds one node index per node: the slots of a
+// directory's children list those same children sorted by name.
+struct sidecar_node_t {
+    uint8_t name[11];
+    uint8_t attributes;
+    uint32_t size;
+    uint16_t first_cluster;
+    uint32_t parent;
+    uint32_t first_child;
+    uint32_t children_n;
+    uint32_t first_extent;
+    uint32_t extents_n;
+} __attribute__((packed));
+
+struct sidecar_t {
+    void* map;
+    size_t map_size;
+    struct sidecar_header_t* header;
+    struct sidecar_node_t* nodes;
+    uint32_t* order;
+    struct extent_t* extents;
+};
+
+int sidecar_build(struct volume_t* pvolume, const char* sidecar_file_name);
+struct sidecar_t* sidecar_open(struct volume_t* pvolume, const char* sidecar_file_name);
+int sidecar_close(struct sidecar_t* sidecar);
+
+int32_t sidecar_lookup(struct sidecar_t* sidecar, const char* path);
+void sidecar_entry(struct sidecar_t* sidecar, uint32_t node, struct root_entry_t* entry);
+int sidecar_list(struct sidecar_t* sidecar, const char* path, struct root_entry_t*** entries,
+                 uint16_t* entries_n);
+int sidecar_walk(struct sidecar_t* sidecar, walk_callback_t callback, void* arg);
+
+#endif  // SIDECAR_H
@@ -0,0 +1,157 @@
+#include "volume_files.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct collect_job_t {
+    struct volume_file_t* files;
+    size_t files_n;
+    size_t capacity;
+};
+
+struct run_job_t {
+    size_t files_n;
+    size_t buffer_size;
+    volume_file_worker_t worker;
+    void* arg;
+    atomic_size_t next;
+};
+
+int collect_file(const char* path, struct root_entry_t* entry, void* arg) {
+    struct collect_job_t* job = arg;
+
+    if ((entry->attributes >> 4) & 1) return 0;
+
+    if (job->files_n == job->capacity) {
+        size_t new_capacity = job->capacity == 0 ? 64 : job->capacity * 2;
+
+        struct volume_file_t* new_files =
+            realloc(job->files, new_capacity * sizeof(struct volume_file_t));
+        if (new_files == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        job->files = new_files;
+        job->capacity = new_capacity;
+    }
+
+    struct volume_file_t* file = &job->files[job->files_n];
+    file->path = strdup(path);
+    if (file->path == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    file->entry = *entry;
+    job->files_n++;
+
+    return 0;
+}
+
+// Lists every regular file on the volume in directory walk order. The list
+// must be freed with `volume_files_free`.
+int volume_files_collect(struct volume_t* pvolume, struct volume_file_t** files,
+                         size_t* files_n) {
+    if (pvolume == NULL || files == NULL || files_n == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    struct collect_job_t job = {0};
+    if (volume_walk(pvolume, collect_file, &job) != 0) {
+        volume_files_free(job.files, job.files_n);
+        return -1;
+    }
+
+    *files = job.files;
+    *files_n = job.files_n;
+
+    return 0;
+}
+
+void volume_files_free(struct volume_file_t* files, size_t files_n) {
+    if (files == NULL) return;
+
+    for (size_t i = 0; i < files_n; i++) {
+        free(files[i].path);
+    }
+    free(files);
+}
+
+void* run_worker(void* arg) {
+    struct run_job_t* job = arg;
+
+    // Without a buffer this worker claims nothing, whoever has one does the rest
+    uint8_t* buffer = malloc(job->buffer_size);
+    if (buffer == NULL) {
+        return NULL;
+    }
+
+    // Files are handed out one at a time so big files don't hold up a batch
+    while (true) {
+        size_t i = atomic_fetch_add(&job->next, 1);
+        if (i >= job->files_n) break;
+
+        job->worker(i, buffer, job->arg);
+    }
+
+    free(buffer);
+
+    return NULL;
+}
+
+// Calls `worker` once for every index below `files_n`, spread over `threads`
+// threads including the caller, 0 meaning one per CPU. Fails with ENOMEM if
+// no thread could allocate its buffer, in which case nothing was processed.
+int volume_files_run(size_t files_n, unsigned threads, size_t buffer_size,
+                     volume_file_worker_t worker, void* arg) {
+    if (worker == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    struct run_job_t job = {
+        .files_n = files_n,
+        .buffer_size = buffer_size,
+        .worker = worker,
+        .arg = arg,
+    };
+    atomic_init(&job.next, 0);
+
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (unsigned)cpus : 1;
+    }
+    if (threads > files_n) threads = files_n > 0 ? files_n : 1;
+
+    pthread_t* thread_ids = calloc(threads, sizeof(pthread_t));
+    unsigned started = 0;
+    if (thread_ids != NULL) {
+        for (; started < threads - 1; started++) {
+            if (pthread_create(&thread_ids[started], NULL, run_worker, &job) != 0) {
+                break;
+            }
+        }
+    }
+
+    // Run inline if no thread could be started, otherwise help out
+    run_worker(&job);
+
+    for (unsigned i = 0; i < started; i++) {
+        pthread_join(thread_ids[i], NULL);
+    }
+
+    free(thread_ids);
+
+    // Every worker that got going runs until all files are claimed
+    if (atomic_load(&job.next) < files_n) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,26 @@
+#ifndef VOLUME_FILES_H
+#define VOLUME_FILES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "file_reader.h"
+
+// A regular file found by `volume_files_collect`
+struct volume_file_t {
+    char* path;
+    struct root_entry_t entry;
+};
+
+// Processes file `index`, called from any of the worker threads. `buffer` is
+// owned by the calling worker and holds the `buffer_size` bytes passed to
+// `volume_files_run`.
+typedef void (*volume_file_worker_t)(size_t index, uint8_t* buffer, void* arg);
+
+int volume_files_collect(struct volume_t* pvolume, struct volume_file_t** files,
+                         size_t* files_n);
+void volume_files_free(struct volume_file_t* files, size_t files_n);
+int volume_files_run(size_t files_n, unsigned threads, size_t buffer_size,
+                     volume_file_worker_t worker, void* arg);
+
+#endif  // VOLUME_FILES_H